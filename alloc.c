@@ -68,6 +68,12 @@ struct alloc_result
    struct liftoff_rpi_layer **best;
    int best_score;
 
+   /* time the search may take once a valid allocation was found, or -1.
+    * The test commits are only part of it */
+   int64_t time_budget, start;
+   int tests_start;
+   bool budget_hit;
+
    bool has_comp_layer;
    size_t non_comp_layers_len;
 };
@@ -78,20 +84,61 @@ struct alloc_step
    size_t pindex;
 
    struct liftoff_rpi_layer **alloc;
+   struct liftoff_rpi_layer_group *group;
    int score, last_layer_zpos;
    int primary_layer_zpos, primary_plane_zpos;
+   size_t overlays;
 
    char log_prefix[64];
 
    bool composited;
 };
 
+static bool
+layer_allocated_get(struct alloc_step *step, struct liftoff_rpi_layer *layer)
+{
+   size_t i = 0;
+
+   for (; i < step->pindex; i++)
+     {
+        if (step->alloc[i] == layer)
+          return true;
+     }
+
+   return false;
+}
+
+/* group members are placed top to bottom on consecutive planes */
+static struct liftoff_rpi_layer *
+group_next_layer_get(struct alloc_step *step, struct liftoff_rpi_layer_group *group, size_t *placed, size_t *visible)
+{
+   struct liftoff_rpi_layer *layer, *next = NULL;
+   size_t i = group->layers_len;
+
+   *placed = 0;
+   *visible = 0;
+
+   while (i-- > 0)
+     {
+        layer = group->layers[i];
+        if (!layer_visible_get(layer)) continue;
+
+        (*visible)++;
+        if (layer_allocated_get(step, layer))
+          (*placed)++;
+        else if (!next)
+          next = layer;
+     }
+
+   return next;
+}
+
 static void
 plane_step_init_next(struct alloc_step *step, struct alloc_step *prev, struct liftoff_rpi_layer *layer)
 {
    struct liftoff_rpi_plane *plane;
    struct liftoff_rpi_property *zprop = NULL;
-   size_t len;
+   size_t len, placed, visible;
 
    plane = liftoff_rpi_container_of(prev->plink, plane, link);
    step->plink = prev->plink->next;
@@ -99,6 +146,16 @@ plane_step_init_next(struct alloc_step *step, struct alloc_step *prev, struct li
    step->alloc = prev->alloc;
    step->alloc[prev->pindex] = layer;
 
+   if (layer && layer->group)
+     {
+        if (group_next_layer_get(step, layer->group, &placed, &visible))
+          step->group = layer->group;
+        else
+          step->group = NULL;
+     }
+   else
+     step->group = prev->group;
+
    if (layer && layer == layer->output->comp_layer)
      {
         /* assert(!prev->composited); */
@@ -112,6 +169,10 @@ plane_step_init_next(struct alloc_step *step, struct alloc_step *prev, struct li
    else
      step->score = prev->score;
 
+   step->overlays = prev->overlays;
+   if (layer && plane->type != DRM_PLANE_TYPE_PRIMARY)
+     step->overlays++;
+
    if (layer)
      zprop = layer_property_get(layer, LIFTOFF_RPI_PROP_ZPOS);
 
@@ -143,18 +204,47 @@ plane_step_init_next(struct alloc_step *step, struct alloc_step *prev, struct li
      memcpy(step->log_prefix, prev->log_prefix, sizeof(step->log_prefix));
 }
 
-static bool
-layer_allocated_get(struct alloc_step *step, struct liftoff_rpi_layer *layer)
+static size_t
+planes_usable_count(struct liftoff_rpi_output *output, struct liftoff_rpi_list *plink)
 {
-   size_t i = 0;
+   struct liftoff_rpi_plane *plane;
+   size_t n = 0;
 
-   for (; i < step->pindex; i++)
+   for (; plink != &output->dev->planes; plink = plink->next)
      {
-        if (step->alloc[i] == layer)
-          return true;
+        plane = liftoff_rpi_container_of(plink, plane, link);
+        if (plane->type == DRM_PLANE_TYPE_PRIMARY ||
+            !plane_usable_get(plane, output))
+          continue;
+        n++;
      }
 
-   return false;
+   return n;
+}
+
+static bool
+layer_group_compatible_get(struct alloc_step *step, struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane)
+{
+   struct liftoff_rpi_layer_group *group;
+   size_t placed, visible;
+
+   if (step->group && layer->group != step->group)
+     return false;
+
+   group = layer->group;
+   if (!group) return true;
+
+   if (plane->type == DRM_PLANE_TYPE_PRIMARY)
+     return false;
+
+   if (group_next_layer_get(step, group, &placed, &visible) != layer)
+     return false;
+
+   if (placed == 0 &&
+       planes_usable_count(layer->output, step->plink) < visible)
+     return false;
+
+   return true;
 }
 
 static bool
@@ -254,7 +344,11 @@ layer_plane_compatible_get(struct alloc_step *step, struct liftoff_rpi_layer *la
    if (layer_allocated_get(step, layer))
      return false;
 
-   zprop = layer_property_get(layer, LIFTOFF_RPI_PROP_ZPOS);
+   /* plane zpos gets programmed from the layer order */
+   zprop = NULL;
+   if (!output->zpos_free)
+     zprop = layer_property_get(layer, LIFTOFF_RPI_PROP_ZPOS);
+
    if (zprop != NULL)
      {
         if ((int)zprop->value > step->last_layer_zpos &&
@@ -320,6 +414,14 @@ layer_plane_compatible_get(struct alloc_step *step, struct liftoff_rpi_layer *la
 static bool
 alloc_valid_get(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step)
 {
+   if (step->group)
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                        "%sLayer group %p is missing planes",
+                        step->log_prefix, (void *)step->group);
+        return false;
+     }
+
    if (result->has_comp_layer && !step->composited &&
        step->score != (int)result->non_comp_layers_len)
      {
@@ -343,6 +445,134 @@ alloc_valid_get(struct liftoff_rpi_output *output, struct alloc_result *result,
    return true;
 }
 
+/* whether layer a, on the plane at index ia of the list, stacks under
+ * layer b on the plane at ib: the composition layer goes under the layers
+ * with a higher zpos, layers without one over all the others */
+static bool
+layer_stacked_under_get(struct liftoff_rpi_layer *a, size_t ia, struct liftoff_rpi_layer *b, size_t ib)
+{
+   struct liftoff_rpi_layer *comp;
+   struct liftoff_rpi_property *za, *zb;
+
+   comp = a->output->comp_layer;
+   za = layer_property_get(a, LIFTOFF_RPI_PROP_ZPOS);
+   zb = layer_property_get(b, LIFTOFF_RPI_PROP_ZPOS);
+
+   if (za && zb && (int)za->value != (int)zb->value)
+     return (int)za->value < (int)zb->value;
+   if (!za && a == comp) return (b != comp);
+   if (!zb && b == comp) return false;
+   if (!za != !zb) return (zb == NULL);
+   if (a == comp || b == comp) return (a == comp);
+
+   return ia > ib;
+}
+
+/* In mutable zpos mode the planes given a layer get consecutive zpos from
+ * the bottom of the range all planes of the CRTC share, in the order of
+ * their layers. alloc holds the layers of the first alloc_len planes of
+ * the list, or NULL for the planes' current layers. Fails with -EINVAL
+ * if the range is too small. */
+static int
+output_zpos_write(struct liftoff_rpi_output *output, struct liftoff_rpi_layer **alloc, size_t alloc_len, drmModeAtomicReq *req)
+{
+   struct liftoff_rpi_plane *plane, *other;
+   struct liftoff_rpi_layer *layer, *olayer;
+   size_t i = 0, j, used = 0;
+   uint64_t rank;
+   int ret;
+
+   if (!output->zpos_free) return 0;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        layer = alloc ? (i < alloc_len ? alloc[i] : NULL) : plane->layer;
+        if (layer && layer->output == output) used++;
+        i++;
+     }
+
+   if (used == 0) return 0;
+   if (used - 1 > output->zpos_max - output->zpos_min) return -EINVAL;
+
+   i = 0;
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        layer = alloc ? (i < alloc_len ? alloc[i] : NULL) : plane->layer;
+        if (!layer || layer->output != output)
+          {
+             i++;
+             continue;
+          }
+
+        rank = 0;
+        j = 0;
+        liftoff_rpi_list_for_each(other, &output->dev->planes, link)
+          {
+             olayer = alloc ? (j < alloc_len ? alloc[j] : NULL) : other->layer;
+             if (olayer && olayer->output == output && olayer != layer &&
+                 layer_stacked_under_get(olayer, j, layer, i))
+               rank++;
+             j++;
+          }
+
+        ret = plane_zpos_set(plane, req, output->zpos_min + rank);
+        if (ret != 0) return ret;
+        i++;
+     }
+
+   return 0;
+}
+
+/* retries a layer the kernel rejected with the values of the relaxation
+ * table it would otherwise keep */
+static int
+layer_relaxed_test(struct alloc_result *result, struct alloc_step *step, struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, int cur, int ret)
+{
+   uint32_t relaxed;
+
+   if (layer_relax_plane_get(layer, plane)) return ret;
+
+   relaxed = plane_relaxed_get(plane, layer);
+   layer_relax_plane_add(layer, plane);
+   if (plane_relaxed_get(plane, layer) == relaxed)
+     {
+        layer_relax_plane_remove(layer, plane);
+        return ret;
+     }
+
+   drmModeAtomicSetCursor(result->req, cur);
+   ret = plane_apply(plane, layer, result->req);
+   if (ret == 0)
+     ret = output_zpos_write(layer->output, step->alloc, step->pindex + 1,
+                             result->req);
+   if (ret == 0)
+     {
+        ret = device_test_commit(plane->dev, result->req, result->flags);
+        trace_test_commit(layer->output, plane, layer, ret);
+     }
+
+   if (ret != 0)
+     layer_relax_plane_remove(layer, plane);
+   else
+     liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                     "Layer %p -> plane %"PRIu32": fits with relaxed "
+                     "properties", (void *)layer, plane->id);
+
+   return ret;
+}
+
+/* checked before each test commit, not just each plane: a plane may try
+ * every layer */
+static bool
+alloc_budget_spent_get(struct alloc_result *result)
+{
+   if (result->time_budget < 0 || result->best_score < 0) return false;
+   if (timing_now_get() - result->start < result->time_budget) return false;
+
+   result->budget_hit = true;
+   return true;
+}
+
 static int
 output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step)
 {
@@ -350,9 +580,11 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
    struct liftoff_rpi_plane *plane;
    struct liftoff_rpi_layer *layer;
    int cur, ret;
-   size_t rplanes;
+   size_t rplanes, placed, visible;
    struct alloc_step nstep = {0};
    const char *type = NULL;
+   int64_t start = 0;
+   bool first = true, best = false;
 
    dev = output->dev;
 
@@ -368,8 +600,10 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
              result->best_score = step->score;
              memcpy(result->best, step->alloc,
                     result->planes_len * sizeof(struct liftoff_rpi_layer *));
+             best = true;
           }
 
+        dump_leaf(output, step->score, best);
         return 0;
      }
 
@@ -377,14 +611,38 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
 
    rplanes = result->planes_len - step->pindex;
    if (result->best_score >= step->score + (int)rplanes)
-     return 0;
+     {
+        dump_node_pruned(output, plane, step->pindex, step->score, "bound");
+        return 0;
+     }
+
+   if (alloc_budget_spent_get(result))
+     {
+        dump_node_pruned(output, plane, step->pindex, step->score, "budget");
+        return 0;
+     }
+
+   if (step->group)
+     {
+        group_next_layer_get(step, step->group, &placed, &visible);
+        if (planes_usable_count(output, step->plink) < visible - placed)
+          {
+             dump_node_pruned(output, plane, step->pindex, step->score,
+                              "group");
+             return 0;
+          }
+     }
+
+   if (dump_enabled(output)) start = timing_now_get();
+   dump_node_begin(output, plane, step->pindex, step->score);
 
    cur = drmModeAtomicGetCursor(result->req);
 
-   if (plane->layer != NULL)
+   if (!plane_usable_get(plane, output))
      goto skip;
 
-   if ((plane->possible_crtcs & (1 << output->crtc_index)) == 0)
+   if (plane->type != DRM_PLANE_TYPE_PRIMARY && output->plane_max >= 0 &&
+       step->overlays >= (size_t)output->plane_max)
      goto skip;
 
    switch (plane->type)
@@ -407,6 +665,7 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
 
    liftoff_rpi_list_for_each(layer, &output->layers, link)
      {
+        if (alloc_budget_spent_get(result)) break;
         if (layer->plane != NULL) continue;
         if (!layer_visible_get(layer))
           {
@@ -415,12 +674,22 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
              /*                 step->log_prefix, (void *)layer); */
              continue;
           }
+        if (output->idle && layer != output->comp_layer)
+          continue;
+        if (!layer_group_compatible_get(step, layer, plane))
+          {
+             dump_try(output, &first, layer, "group");
+             layer->comp_reasons |= LIFTOFF_RPI_COMP_GROUP;
+             continue;
+          }
         if (!layer_plane_compatible_get(step, layer, plane))
           {
              liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
                              "%s Layer %p -> plane %"PRIu32": "
                              "Not Compatible",
                              step->log_prefix, (void *)layer, plane->id);
+             dump_try(output, &first, layer, "zpos");
+             layer->comp_reasons |= LIFTOFF_RPI_COMP_ZPOS;
              continue;
           }
 
@@ -431,7 +700,8 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
                              "%s Layer %p -> plane %"PRIu32": "
                              "incompatible properties",
                              step->log_prefix, (void *)layer, plane->id);
-
+             dump_try(output, &first, layer, "props");
+             layer->comp_reasons |= LIFTOFF_RPI_COMP_PROPS;
              continue;
           }
         else if (ret != 0)
@@ -441,11 +711,37 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
 
         if (layer->force_comp || !plane_check_layer_fb(plane, layer))
           {
+             dump_try(output, &first, layer,
+                      layer->force_comp ? "force_comp" : "fb");
+             layer->comp_reasons |= (layer->force_comp ?
+                                     LIFTOFF_RPI_COMP_FORCE :
+                                     LIFTOFF_RPI_COMP_FB);
+             drmModeAtomicSetCursor(result->req, cur);
+             continue;
+          }
+
+        step->alloc[step->pindex] = layer;
+        ret = output_zpos_write(output, step->alloc, step->pindex + 1,
+                                result->req);
+        if (ret == -EINVAL)
+          {
+             liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                             "%s Layer %p -> plane %"PRIu32": "
+                             "out of zpos values",
+                             step->log_prefix, (void *)layer, plane->id);
+             dump_try(output, &first, layer, "zpos");
+             layer->comp_reasons |= LIFTOFF_RPI_COMP_ZPOS;
              drmModeAtomicSetCursor(result->req, cur);
              continue;
           }
+        else if (ret != 0)
+          return ret;
 
         ret = device_test_commit(dev, result->req, result->flags);
+        trace_test_commit(output, plane, layer, ret);
+        if ((ret == -EINVAL || ret == -ERANGE) && output->relax)
+          ret = layer_relaxed_test(result, step, plane, layer, cur, ret);
+        dump_try_test(output, &first, layer, ret);
         if (ret == 0)
           {
              liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
@@ -456,6 +752,7 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
              ret = output_layers_choose(output, result, &nstep);
              if (ret != 0)
                return ret;
+             dump_try_end(output);
           }
         else if (ret != -EINVAL && ret != -ERANGE && ret != -ENOSPC)
           {
@@ -473,15 +770,18 @@ output_layers_choose(struct liftoff_rpi_output *output, struct alloc_result *res
                              "test-only commit failed (%s)",
                              step->log_prefix, (void *)layer, plane->id,
                              strerror(-ret));
+             layer->comp_reasons |= LIFTOFF_RPI_COMP_TEST;
           }
 
         drmModeAtomicSetCursor(result->req, cur);
      }
 
 skip:
+   dump_node_skip(output);
    plane_step_init_next(&nstep, step, NULL);
    ret = output_layers_choose(output, result, &nstep);
    if (ret != 0) return ret;
+   dump_node_end(output, start);
    drmModeAtomicSetCursor(result->req, cur);
    return 0;
 }
@@ -504,31 +804,111 @@ apply_current(struct liftoff_rpi_output *output, drmModeAtomicReq *req)
           }
      }
 
-   return 0;
+   ret = output_zpos_write(output, NULL, 0, req);
+   if (ret != 0) drmModeAtomicSetCursor(req, cur);
+
+   return ret;
 }
 
+/* the reuse test commit validates whatever this can't check */
 static bool
-layer_fb_info_needs_realloc(const drmModeFB2 *a, const drmModeFB2 *b)
+layer_plane_fb_fits_get(struct liftoff_rpi_layer *layer)
 {
-   if (a->width != b->width || a->height != b->height ||
-       a->pixel_format != b->pixel_format || a->modifier != b->modifier) 
-     return true;
+   struct liftoff_rpi_device *dev;
 
-   /* TODO: consider checking pitch and offset? */
+   if (!layer->plane) return false;
 
-   return false;
+   if (!plane_check_layer_fb(layer->plane, layer))
+     return false;
+
+   dev = layer->output->dev;
+   if (!layer->fb ||
+       layer->fb->width < dev->min_width ||
+       layer->fb->width > dev->max_width ||
+       layer->fb->height < dev->min_height ||
+       layer->fb->height > dev->max_height)
+     return false;
+
+   liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                   "Layer %p FB changed, keeping plane %"PRIu32,
+                   (void *)layer, layer->plane->id);
+   return true;
 }
 
 static void
-layers_fb_info_update(struct liftoff_rpi_output *output)
+layers_fb_update(struct liftoff_rpi_output *output)
 {
    struct liftoff_rpi_layer *layer;
 
    liftoff_rpi_list_for_each(layer, &output->layers, link)
      {
-        memset(&layer->fb_info, 0, sizeof(layer->fb_info));
-        layer_cache_fb_info(layer);
+        /* FB IDs get reused, so look again */
+        layer->fb_id = 0;
+        fb_layer_update(layer);
+     }
+}
+
+static bool
+layer_offloaded_overlap_get(struct liftoff_rpi_layer *layer, bool prev)
+{
+   struct liftoff_rpi_layer *olayer;
+   struct liftoff_rpi_rect rect, orect;
+
+   layer_rect_get(layer, &rect, prev);
+
+   liftoff_rpi_list_for_each(olayer, &layer->output->layers, link)
+     {
+        if (olayer == layer || olayer == layer->output->comp_layer)
+          continue;
+        if (!olayer->plane || !layer_visible_get(olayer))
+          continue;
+
+        layer_rect_get(olayer, &orect, false);
+        if (rect_intersects(&rect, &orect))
+          return true;
+     }
+
+   return false;
+}
+
+/* A layer composited for reasons its geometry can't affect stays composited
+ * when it moves, unless it starts or stops overlapping an offloaded layer */
+static bool
+layer_comp_change_relevant_get(struct liftoff_rpi_layer *layer, int property)
+{
+   uint32_t fixed;
+
+   switch (property)
+     {
+      case LIFTOFF_RPI_PROP_CRTC_X:
+      case LIFTOFF_RPI_PROP_CRTC_Y:
+      case LIFTOFF_RPI_PROP_CRTC_W:
+      case LIFTOFF_RPI_PROP_CRTC_H:
+      case LIFTOFF_RPI_PROP_SRC_X:
+      case LIFTOFF_RPI_PROP_SRC_Y:
+      case LIFTOFF_RPI_PROP_SRC_W:
+      case LIFTOFF_RPI_PROP_SRC_H:
+      case LIFTOFF_RPI_PROP_ZPOS:
+        break;
+      default:
+        return true;
      }
+
+   if (layer->plane || !layer->composited ||
+       layer == layer->output->comp_layer)
+     return true;
+
+   fixed = LIFTOFF_RPI_COMP_FORCE | LIFTOFF_RPI_COMP_FB |
+     LIFTOFF_RPI_COMP_PROPS;
+   if (!layer->force_comp &&
+       (layer->comp_reasons == 0 || (layer->comp_reasons & ~fixed) != 0))
+     return true;
+
+   if (layer_offloaded_overlap_get(layer, true) ||
+       layer_offloaded_overlap_get(layer, false))
+     return true;
+
+   return false;
 }
 
 static bool
@@ -551,7 +931,9 @@ layer_realloc_get(struct liftoff_rpi_layer *layer)
              if (prop->value == 0 || prop->prev_value == 0)
                return true;
 
-             if (layer_fb_info_needs_realloc(&layer->fb_info, &layer->prev_fb_info))
+             /* descriptors are interned, see fb.c */
+             if (layer->fb != layer->prev_fb &&
+                 !layer_plane_fb_fits_get(layer))
                return true;
 
              continue;
@@ -572,6 +954,18 @@ layer_realloc_get(struct liftoff_rpi_layer *layer)
             prop->index == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS)
           continue;
 
+        /* the source rectangle doesn't take part in any allocation
+         * constraint, leave it to the test commit */
+        if (layer->plane &&
+            (prop->index == LIFTOFF_RPI_PROP_SRC_X ||
+             prop->index == LIFTOFF_RPI_PROP_SRC_Y ||
+             prop->index == LIFTOFF_RPI_PROP_SRC_W ||
+             prop->index == LIFTOFF_RPI_PROP_SRC_H))
+          continue;
+
+        if (!layer_comp_change_relevant_get(layer, prop->index))
+          continue;
+
         /* TODO: if CRTC_{X,Y,W,H} changed but intersection with other
          * layers hasn't changed, don't realloc */
         return true;
@@ -588,7 +982,7 @@ reuse_prev_alloc(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint3
    int cur, ret;
 
    dev = output->dev;
-   if (output->layers_changed) return -EINVAL;
+   if (output->layers_changed || output->realloc_deferred) return -EINVAL;
 
    liftoff_rpi_list_for_each(layer, &output->layers, link)
      {
@@ -602,6 +996,7 @@ reuse_prev_alloc(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint3
    if (ret != 0) return ret;
 
    ret = device_test_commit(dev, req, flags);
+   trace_test_commit(output, NULL, NULL, ret);
    if (ret != 0) drmModeAtomicSetCursor(req, cur);
 
    return ret;
@@ -682,56 +1077,1226 @@ non_comp_layers_len(struct liftoff_rpi_output *output)
    return n;
 }
 
-int
-liftoff_rpi_output_apply(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags)
+static int64_t
+layers_fb_change_time_get(struct liftoff_rpi_output *output, size_t *len)
 {
-   struct liftoff_rpi_device *dev;
-   struct liftoff_rpi_plane *plane;
    struct liftoff_rpi_layer *layer;
-   struct alloc_result result = {0};
-   struct alloc_step step = {0};
-   size_t i = 0, cand = 0;
-   const char *type = NULL;
-   int ret;
+   int64_t last = 0;
 
-   dev = output->dev;
+   *len = 0;
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer == output->comp_layer || !layer_visible_get(layer))
+          continue;
 
-   layers_priority_update(dev);
-   layers_fb_info_update(output);
+        (*len)++;
+        if (layer->fb_change_time > last)
+          last = layer->fb_change_time;
+     }
 
-   ret = reuse_prev_alloc(output, req, flags);
-   if (ret == 0)
+   return last;
+}
+
+static void
+output_idle_update(struct liftoff_rpi_output *output)
+{
+   int64_t last;
+   size_t len;
+   bool idle = false;
+
+   if (output->idle_timeout > 0 && output->comp_layer)
      {
-        log_reuse(output);
-        return 0;
+        /* consolidating a single layer only adds a GPU pass */
+        last = layers_fb_change_time_get(output, &len);
+        if (len > 1 && last != output->idle_reject &&
+            timing_now_get() - last >= output->idle_timeout)
+          idle = true;
      }
 
-   log_no_reuse(output);
+   if (idle == output->idle) return;
 
-   liftoff_rpi_list_for_each(layer, &output->layers, link)
-     layer_candidate_planes_reset(layer);
+   liftoff_rpi_log(LIFTOFF_RPI_DEBUG, "Output %p %s idle consolidation",
+                   (void *)output, idle ? "entering" : "leaving");
 
-   dev->test_commit_counter = 0;
+   output->idle = idle;
+   output->layers_changed = true;
+}
 
-   output_log_layers(output);
+static bool
+output_noop_get(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_layer *layer;
+   struct liftoff_rpi_property *prop;
+   size_t i = 0;
 
-   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+   /* a deferred reallocation is still owed, even to an unchanged scene */
+   if (!output->applied || output->layers_changed || output->comp_dirty ||
+       output->realloc_deferred)
+     return false;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
      {
-        if (plane->layer && plane->layer->output == output)
+        if (layer->changed) return false;
+
+        if (layer->force_comp && liftoff_rpi_layer_needs_composition(layer))
+          return false;
+
+        for (i = 0; i < layer->props_len; i++)
           {
-             plane->layer->plane = NULL;
-             plane->layer = NULL;
+             prop = &layer->props[i];
+
+             if (prop->index == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS &&
+                 prop->value != 0)
+               return false;
+             if (prop->index == LIFTOFF_RPI_PROP_IN_FENCE_FD &&
+                 prop->value != (uint64_t)-1)
+               return false;
+             if (prop->value != prop->prev_value)
+               return false;
           }
      }
 
-   liftoff_rpi_list_for_each(plane, &dev->planes, link)
-     {
-        if (plane->layer == NULL)
-          {
-             cand++;
-
-             liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
-                             "Disabling plane %"PRIu32, plane->id);
+   return true;
+}
+
+static void
+alloc_step_init(struct liftoff_rpi_output *output, struct alloc_step *step)
+{
+   step->plink = output->dev->planes.next;
+   step->pindex = 0;
+   step->group = NULL;
+   step->score = 0;
+   step->last_layer_zpos = INT_MAX;
+   step->primary_layer_zpos = INT_MIN;
+   step->primary_plane_zpos = INT_MAX;
+   step->overlays = 0;
+   step->log_prefix[0] = '\0';
+   step->composited = false;
+}
+
+static void
+alloc_search_init(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step)
+{
+   struct liftoff_rpi_layer *layer;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        layer_candidate_planes_reset(layer);
+        layer->comp_reasons = 0;
+     }
+
+   result->best_score = -1;
+   memset(result->best, 0, result->planes_len * sizeof(*result->best));
+
+   alloc_step_init(output, step);
+}
+
+/* the exhaustive search only keeps allocations that passed a test commit,
+ * other strategies get checked here */
+static bool
+alloc_result_test(struct liftoff_rpi_output *output, struct alloc_result *result)
+{
+   struct liftoff_rpi_plane *plane;
+   size_t i = 0;
+   int cur, ret = 0;
+
+   cur = drmModeAtomicGetCursor(result->req);
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (result->best[i])
+          ret = plane_apply(plane, result->best[i], result->req);
+        i++;
+        if (ret != 0) break;
+     }
+
+   if (ret == 0)
+     ret = output_zpos_write(output, result->best, result->planes_len,
+                             result->req);
+   if (ret == 0)
+     ret = device_test_commit(output->dev, result->req, result->flags);
+
+   drmModeAtomicSetCursor(result->req, cur);
+
+   return ret == 0;
+}
+
+/* checks an allocation not found by the search against its rules */
+static bool
+alloc_result_valid_get(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step)
+{
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   struct alloc_step cur, next;
+   size_t i = 0;
+
+   cur = *step;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        layer = result->best[i];
+        if (layer && plane->reserved && plane->reserved != output)
+          return false;
+        if (layer && !layer_plane_compatible_get(&cur, layer, plane))
+          return false;
+
+        plane_step_init_next(&next, &cur, layer);
+        cur = next;
+        i++;
+     }
+
+   if (output->plane_max >= 0 && cur.overlays > (size_t)output->plane_max)
+     return false;
+
+   return alloc_valid_get(output, result, &cur);
+}
+
+/* zpos dynamic programming
+ *
+ * When every visible layer has a zpos, placing layers on planes in the same
+ * order satisfies the zpos rules, and the best allocation is a longest
+ * common subsequence of the layers and planes sorted by zpos, restricted to
+ * the pairs that can work together. Those pairs are worked out locally, the
+ * kernel only gets to test the chosen path. A layer that gets composited
+ * drags down the intersecting layers under it, which is handled by
+ * excluding those and solving again. */
+
+struct zpos_dp
+{
+   /* both by ascending zpos, planes[0] is the primary plane if usable */
+   struct liftoff_rpi_layer **layers;
+   struct liftoff_rpi_plane **planes;
+   size_t layers_len, planes_len;
+   bool has_primary, comp_ok;
+
+   bool *compat;
+   bool *excluded;
+   ssize_t *assign;
+   int *score;
+};
+
+static bool
+output_zpos_dp_usable(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_layer *layer;
+
+   if (output->idle || !liftoff_rpi_list_empty(&output->groups))
+     return false;
+
+   /* the DP has no notion of a plane budget, and only pays off when
+    * planes have a fixed order */
+   if (output->plane_max >= 0 || output->zpos_free) return false;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer == output->comp_layer || !layer_visible_get(layer))
+          continue;
+        if (!layer_property_get(layer, LIFTOFF_RPI_PROP_ZPOS))
+          return false;
+     }
+
+   return true;
+}
+
+static uint64_t
+layer_zpos_get(struct liftoff_rpi_layer *layer)
+{
+   return layer_property_get(layer, LIFTOFF_RPI_PROP_ZPOS)->value;
+}
+
+static bool
+zpos_dp_pair_get(struct liftoff_rpi_output *output, drmModeAtomicReq *req, struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, int *ret)
+{
+   int cur;
+
+   *ret = 0;
+   if (layer->force_comp) return false;
+
+   cur = drmModeAtomicGetCursor(req);
+   *ret = plane_apply(plane, layer, req);
+   drmModeAtomicSetCursor(req, cur);
+
+   if (*ret == -EINVAL)
+     {
+        *ret = 0;
+        return false;
+     }
+   else if (*ret != 0)
+     return false;
+
+   layer_candidate_plane_add(layer, plane);
+
+   return plane_check_layer_fb(plane, layer);
+}
+
+static int
+zpos_dp_init(struct liftoff_rpi_output *output, struct alloc_result *result, struct zpos_dp *dp)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_layer *layer;
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_list *plink;
+   size_t i, j, n = 0, m;
+   int ret;
+
+   dev = output->dev;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     n++;
+   m = result->planes_len;
+
+   dp->layers = malloc(n * sizeof(*dp->layers));
+   dp->planes = malloc(m * sizeof(*dp->planes));
+   dp->compat = malloc(n * m * sizeof(*dp->compat));
+   dp->excluded = malloc(n * sizeof(*dp->excluded));
+   dp->assign = malloc(n * sizeof(*dp->assign));
+   dp->score = malloc((n + 1) * (m + 1) * sizeof(*dp->score));
+   if (!dp->layers || !dp->planes || !dp->compat || !dp->excluded ||
+       !dp->assign || !dp->score)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "malloc");
+        return -ENOMEM;
+     }
+
+   /* insertion sort, there are only a handful of layers */
+   dp->layers_len = 0;
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer == output->comp_layer || !layer_visible_get(layer))
+          continue;
+
+        i = dp->layers_len++;
+        while (i > 0 && layer_zpos_get(dp->layers[i - 1]) > layer_zpos_get(layer))
+          {
+             dp->layers[i] = dp->layers[i - 1];
+             i--;
+          }
+        dp->layers[i] = layer;
+     }
+
+   /* the list has the primary plane first, then descending zpos */
+   dp->planes_len = 0;
+   dp->has_primary = false;
+   for (plink = dev->planes.prev; plink != &dev->planes; plink = plink->prev)
+     {
+        plane = liftoff_rpi_container_of(plink, plane, link);
+        if (!plane_usable_get(plane, output)) continue;
+        if (plane->type == DRM_PLANE_TYPE_PRIMARY)
+          {
+             if (dp->has_primary) continue;
+             memmove(dp->planes + 1, dp->planes,
+                     dp->planes_len * sizeof(*dp->planes));
+             dp->planes[0] = plane;
+             dp->has_primary = true;
+          }
+        else
+          dp->planes[dp->planes_len] = plane;
+        dp->planes_len++;
+     }
+
+   for (i = 0; i < dp->layers_len; i++)
+     {
+        for (j = 0; j < dp->planes_len; j++)
+          {
+             dp->compat[i * dp->planes_len + j] =
+               zpos_dp_pair_get(output, result->req, dp->planes[j],
+                                dp->layers[i], &ret);
+             if (ret != 0) return ret;
+          }
+     }
+
+   dp->comp_ok = false;
+   if (output->comp_layer && dp->has_primary)
+     {
+        dp->comp_ok = zpos_dp_pair_get(output, result->req, dp->planes[0],
+                                       output->comp_layer, &ret);
+        if (ret != 0) return ret;
+     }
+
+   return 0;
+}
+
+static void
+zpos_dp_fini(struct zpos_dp *dp)
+{
+   free(dp->layers);
+   free(dp->planes);
+   free(dp->compat);
+   free(dp->excluded);
+   free(dp->assign);
+   free(dp->score);
+}
+
+/* longest common subsequence of layers and planes[first..] */
+static size_t
+zpos_dp_solve(struct zpos_dp *dp, size_t first)
+{
+   size_t i, j, n, m, placed = 0;
+   int *score, best;
+   bool diag;
+
+   n = dp->layers_len;
+   m = dp->planes_len - first;
+   score = dp->score;
+
+# define S(a, b) score[(a) * (m + 1) + (b)]
+# define PAIR(a, b) (!dp->excluded[(a) - 1] && \
+                     dp->compat[((a) - 1) * dp->planes_len + first + (b) - 1])
+
+   for (i = 0; i <= n; i++) S(i, 0) = 0;
+   for (j = 0; j <= m; j++) S(0, j) = 0;
+
+   for (i = 1; i <= n; i++)
+     {
+        for (j = 1; j <= m; j++)
+          {
+             best = S(i - 1, j) > S(i, j - 1) ? S(i - 1, j) : S(i, j - 1);
+             if (PAIR(i, j) && S(i - 1, j - 1) + 1 > best)
+               best = S(i - 1, j - 1) + 1;
+             S(i, j) = best;
+          }
+     }
+
+   for (i = 0; i < n; i++) dp->assign[i] = -1;
+
+   /* walk back from the top, keeping higher layers on higher planes */
+   i = n;
+   j = m;
+   while (i > 0 && j > 0)
+     {
+        diag = PAIR(i, j) && S(i, j) == S(i - 1, j - 1) + 1;
+        if (diag)
+          {
+             dp->assign[i - 1] = (ssize_t)(first + j - 1);
+             placed++;
+             i--;
+             j--;
+          }
+        else if (S(i, j) == S(i - 1, j))
+          i--;
+        else
+          j--;
+     }
+
+# undef PAIR
+# undef S
+
+   return placed;
+}
+
+/* a composited layer can't have an offloaded layer under it */
+static bool
+zpos_dp_closure(struct zpos_dp *dp)
+{
+   size_t a = 0, b;
+   bool changed = false;
+
+   for (; a < dp->layers_len; a++)
+     {
+        if (dp->assign[a] >= 0) continue;
+
+        for (b = 0; b < dp->layers_len; b++)
+          {
+             if (dp->assign[b] < 0) continue;
+             if (layer_zpos_get(dp->layers[b]) >= layer_zpos_get(dp->layers[a]))
+               continue;
+             if (!layer_intersects(dp->layers[a], dp->layers[b]))
+               continue;
+
+             dp->excluded[b] = true;
+             dp->assign[b] = -1;
+             changed = true;
+          }
+     }
+
+   return changed;
+}
+
+static void
+zpos_dp_result_fill(struct liftoff_rpi_output *output, struct alloc_result *result, struct zpos_dp *dp, bool comp)
+{
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   size_t i, p = 0;
+
+   memset(result->best, 0, result->planes_len * sizeof(*result->best));
+   result->best_score = 0;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        layer = NULL;
+        if (comp && plane == dp->planes[0])
+          layer = output->comp_layer;
+
+        for (i = 0; i < dp->layers_len && !layer; i++)
+          {
+             if (dp->assign[i] >= 0 && dp->planes[dp->assign[i]] == plane)
+               {
+                  layer = dp->layers[i];
+                  result->best_score++;
+               }
+          }
+
+        result->best[p++] = layer;
+     }
+}
+
+static bool
+zpos_dp_run(struct liftoff_rpi_output *output, struct alloc_result *result, struct zpos_dp *dp)
+{
+   size_t placed = 0, first;
+
+   memset(dp->excluded, 0, dp->layers_len * sizeof(*dp->excluded));
+
+   /* without composition the bottom layer can take the primary plane */
+   if (dp->has_primary)
+     {
+        placed = zpos_dp_solve(dp, 0);
+        if (placed == dp->layers_len)
+          {
+             /* keep the primary plane lit, like the search does */
+             if (placed > 0 && dp->assign[0] > 0 && dp->compat[0])
+               dp->assign[0] = 0;
+             zpos_dp_result_fill(output, result, dp, false);
+             return true;
+          }
+
+        if (!output->comp_layer)
+          {
+             while (zpos_dp_closure(dp))
+               zpos_dp_solve(dp, 0);
+             zpos_dp_result_fill(output, result, dp, false);
+             return true;
+          }
+     }
+
+   first = dp->has_primary ? 1 : 0;
+   do
+     placed = zpos_dp_solve(dp, first);
+   while (zpos_dp_closure(dp));
+
+   if (placed == dp->layers_len || !output->comp_layer)
+     {
+        zpos_dp_result_fill(output, result, dp, false);
+        return true;
+     }
+
+   if (!dp->comp_ok) return false;
+
+   zpos_dp_result_fill(output, result, dp, true);
+   return true;
+}
+
+/* finds the pair the kernel doesn't like by adding planes one at a time, in
+ * the search's order */
+static int
+zpos_dp_reject(struct liftoff_rpi_output *output, struct alloc_result *result, struct zpos_dp *dp, bool *found)
+{
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   size_t i = 0, l, p;
+   int cur, ret = 0;
+
+   *found = false;
+   cur = drmModeAtomicGetCursor(result->req);
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        layer = result->best[i++];
+        if (!layer) continue;
+
+        ret = plane_apply(plane, layer, result->req);
+        if (ret != 0) break;
+
+        ret = device_test_commit(output->dev, result->req, result->flags);
+        trace_test_commit(output, plane, layer, ret);
+        if (ret == 0) continue;
+        if (ret != -EINVAL && ret != -ERANGE && ret != -ENOSPC) break;
+
+        ret = 0;
+        if (layer == output->comp_layer)
+          dp->comp_ok = false;
+
+        for (l = 0; l < dp->layers_len; l++)
+          {
+             if (dp->layers[l] != layer) continue;
+             for (p = 0; p < dp->planes_len; p++)
+               {
+                  if (dp->planes[p] == plane)
+                    dp->compat[l * dp->planes_len + p] = false;
+               }
+          }
+
+        layer->comp_reasons |= LIFTOFF_RPI_COMP_TEST;
+        *found = true;
+        break;
+     }
+
+   drmModeAtomicSetCursor(result->req, cur);
+   return ret;
+}
+
+/* layers any allocation could give a plane */
+static int
+zpos_dp_placeable_get(struct zpos_dp *dp)
+{
+   size_t i = 0;
+   int n = 0;
+
+   for (; i < dp->layers_len; i++)
+     {
+        if (!dp->layers[i]->force_comp) n++;
+     }
+
+   return n;
+}
+
+static int
+output_zpos_dp_choose(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step)
+{
+   struct zpos_dp dp = {0};
+   size_t tries = 0, i;
+   int ret;
+   bool found;
+
+   /* nothing to place, and the tables would be empty */
+   if (liftoff_rpi_list_empty(&output->layers))
+     return output_layers_choose(output, result, step);
+
+   ret = zpos_dp_init(output, result, &dp);
+   if (ret != 0) goto out;
+
+   /* each rejection rules out a pair */
+   for (; tries <= dp.layers_len * dp.planes_len; tries++)
+     {
+        if (!zpos_dp_run(output, result, &dp)) break;
+
+        if (!alloc_result_valid_get(output, result, step))
+          {
+             liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                             "zpos allocation for output %p breaks the "
+                             "search rules", (void *)output);
+             break;
+          }
+
+        if (alloc_result_test(output, result))
+          {
+             /* the closure and the rejections are greedy, so only a
+              * placement of every layer is known to be the best one.
+              * Otherwise it bounds a search for a better one */
+             if (result->best_score < zpos_dp_placeable_get(&dp))
+               {
+                  liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                                  "zpos allocation for output %p left "
+                                  "layers out, searching for better",
+                                  (void *)output);
+                  dump_leaf(output, result->best_score, true);
+                  ret = output_layers_choose(output, result, step);
+                  goto out;
+               }
+
+             for (i = 0; i < dp.layers_len; i++)
+               {
+                  if (dp.assign[i] >= 0) continue;
+                  dp.layers[i]->comp_reasons |= (dp.layers[i]->force_comp ?
+                                                 LIFTOFF_RPI_COMP_FORCE :
+                                                 LIFTOFF_RPI_COMP_ZPOS);
+               }
+
+             dump_leaf(output, result->best_score, true);
+             goto out;
+          }
+
+        ret = zpos_dp_reject(output, result, &dp, &found);
+        if (ret != 0 || !found) break;
+     }
+
+   if (ret == 0)
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                        "zpos allocation failed for output %p, "
+                        "searching instead", (void *)output);
+        result->best_score = -1;
+        memset(result->best, 0, result->planes_len * sizeof(*result->best));
+        ret = output_layers_choose(output, result, step);
+     }
+
+out:
+   zpos_dp_fini(&dp);
+   return ret;
+}
+
+/* visible layers x planes they could go on, which drives the size of the
+ * search tree */
+static size_t
+output_search_size_get(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   size_t layers = 0, planes = 0;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer_visible_get(layer)) layers++;
+     }
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (plane_usable_get(plane, output)) planes++;
+     }
+
+   return layers * planes;
+}
+
+/* a deadline overrides the configured budget, both ways */
+static int64_t
+output_search_budget_get(struct liftoff_rpi_output *output)
+{
+   if (output->deadline_budget >= 0) return output->deadline_budget;
+   return output->search_budget;
+}
+
+/* search sizes grow with layers x planes, so they're averaged by their
+ * bit length: 1, 2-3, 4-7 and so on */
+static uint32_t *
+output_search_tests_get(struct liftoff_rpi_output *output, size_t size)
+{
+   size_t bucket = 0;
+
+   for (; size != 0; size >>= 1)
+     bucket++;
+   if (bucket >= LIFTOFF_RPI_SEARCH_SIZES) bucket = LIFTOFF_RPI_SEARCH_SIZES - 1;
+
+   return &output->search_tests[bucket];
+}
+
+static enum liftoff_rpi_strategy
+output_strategy_auto_get(struct liftoff_rpi_output *output, size_t size, int64_t *time_budget)
+{
+   int64_t latency;
+   uint32_t tests;
+
+   latency = output->dev->test_commit_avg;
+   *time_budget = output_search_budget_get(output);
+
+   tests = *output_search_tests_get(output, size);
+
+   /* small trees are cheap enough to search blindly the first time */
+   if (tests == 0 && size <= 16) return LIFTOFF_RPI_STRATEGY_EXHAUSTIVE;
+   if (tests != 0 && (int64_t)tests * latency <= *time_budget)
+     return LIFTOFF_RPI_STRATEGY_EXHAUSTIVE;
+
+   if (output_zpos_dp_usable(output))
+     return LIFTOFF_RPI_STRATEGY_ZPOS_DP;
+
+   /* the latency is measured by the first test commit if still unknown */
+   if (latency == 0 || *time_budget / latency >= 8)
+     return LIFTOFF_RPI_STRATEGY_BOUNDED;
+
+   *time_budget = 0;
+   return LIFTOFF_RPI_STRATEGY_GREEDY;
+}
+
+static void
+output_search_tests_update(struct liftoff_rpi_output *output, size_t size, int tests)
+{
+   uint32_t *avg;
+
+   avg = output_search_tests_get(output, size);
+
+   if (*avg == 0)
+     *avg = (uint32_t)tests;
+   else
+     *avg = (uint32_t)((int64_t)*avg + ((int64_t)tests - (int64_t)*avg) / 4);
+
+   /* 0 means unknown */
+   if (*avg == 0) *avg = 1;
+}
+
+static bool
+output_memo_apply(struct liftoff_rpi_output *output, struct alloc_result *result, uint64_t signature)
+{
+   struct liftoff_rpi_layer *layer;
+   const int16_t *planes;
+   size_t i = 0;
+   int index;
+
+   planes = memo_lookup(output, signature, result->planes_len);
+   if (!planes) return false;
+
+   result->best_score = 0;
+   for (; i < result->planes_len; i++)
+     {
+        index = 0;
+        result->best[i] = NULL;
+        if (planes[i] < 0) continue;
+
+        liftoff_rpi_list_for_each(layer, &output->layers, link)
+          {
+             if (index++ == planes[i])
+               {
+                  result->best[i] = layer;
+                  break;
+               }
+          }
+
+        if (result->best[i] && result->best[i] != output->comp_layer)
+          result->best_score++;
+     }
+
+   if (!alloc_result_test(output, result))
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                        "Remembered allocation for output %p was rejected",
+                        (void *)output);
+        memo_forget(output, signature);
+        result->best_score = -1;
+        memset(result->best, 0, result->planes_len * sizeof(*result->best));
+        return false;
+     }
+
+   return true;
+}
+
+static void
+output_memo_store(struct liftoff_rpi_output *output, struct alloc_result *result, uint64_t signature)
+{
+   struct liftoff_rpi_layer *layer;
+   int16_t *planes;
+   size_t i = 0;
+   int16_t index;
+
+   planes = malloc(result->planes_len * sizeof(*planes));
+   if (!planes) return;
+
+   for (; i < result->planes_len; i++)
+     {
+        planes[i] = -1;
+        if (!result->best[i]) continue;
+
+        index = 0;
+        liftoff_rpi_list_for_each(layer, &output->layers, link)
+          {
+             if (layer == result->best[i])
+               {
+                  planes[i] = index;
+                  break;
+               }
+             index++;
+          }
+     }
+
+   memo_store(output, signature, planes, result->planes_len);
+   free(planes);
+}
+
+/* alloc_search_init forgets the candidate planes, and a remembered or
+ * budget-cut search doesn't try every pair again: fill in the pairs the
+ * properties allow, as a full search would have found them */
+static int
+output_candidates_complete(struct liftoff_rpi_output *output, struct alloc_result *result)
+{
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   int cur, ret;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (!plane_usable_get(plane, output)) continue;
+
+        liftoff_rpi_list_for_each(layer, &output->layers, link)
+          {
+             if (!layer_visible_get(layer)) continue;
+             if (output->idle && layer != output->comp_layer) continue;
+
+             cur = drmModeAtomicGetCursor(result->req);
+             ret = plane_apply(plane, layer, result->req);
+             drmModeAtomicSetCursor(result->req, cur);
+
+             if (ret == -EINVAL) continue;
+             else if (ret != 0) return ret;
+
+             layer_candidate_plane_add(layer, plane);
+          }
+     }
+
+   return 0;
+}
+
+static int
+output_strategy_run(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step, enum liftoff_rpi_strategy strategy)
+{
+   struct liftoff_rpi_device *dev;
+   uint64_t signature;
+   size_t size;
+   int ret;
+
+   dev = output->dev;
+
+   size = output_search_size_get(output);
+   signature = memo_signature_get(output);
+
+   result->time_budget = -1;
+   result->tests_start = dev->test_commit_counter;
+   result->start = timing_now_get();
+   result->budget_hit = false;
+
+   switch (strategy)
+     {
+      case LIFTOFF_RPI_STRATEGY_AUTO:
+      case LIFTOFF_RPI_STRATEGY_MEMOIZED:
+        if (output_memo_apply(output, result, signature))
+          {
+             strategy = LIFTOFF_RPI_STRATEGY_MEMOIZED;
+             dump_leaf(output, result->best_score, true);
+             ret = output_candidates_complete(output, result);
+             if (ret != 0) return ret;
+             goto done;
+          }
+        if (strategy == LIFTOFF_RPI_STRATEGY_AUTO)
+          strategy = output_strategy_auto_get(output, size,
+                                              &result->time_budget);
+        break;
+      case LIFTOFF_RPI_STRATEGY_BOUNDED:
+        result->time_budget = output_search_budget_get(output);
+        break;
+      case LIFTOFF_RPI_STRATEGY_GREEDY:
+        result->time_budget = 0;
+        break;
+      case LIFTOFF_RPI_STRATEGY_ZPOS_DP:
+        if (!output_zpos_dp_usable(output))
+          strategy = LIFTOFF_RPI_STRATEGY_EXHAUSTIVE;
+        break;
+      case LIFTOFF_RPI_STRATEGY_EXHAUSTIVE:
+      default:
+        break;
+     }
+
+   /* whatever the strategy, a deadline bounds the search */
+   if (result->time_budget < 0 && output->deadline_budget >= 0)
+     result->time_budget = output->deadline_budget;
+
+   liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                   "Searching output %p with strategy %d (size %zu, "
+                   "budget %"PRId64" ns)", (void *)output, strategy, size,
+                   result->time_budget);
+
+   if (strategy == LIFTOFF_RPI_STRATEGY_ZPOS_DP)
+     ret = output_zpos_dp_choose(output, result, step);
+   else
+     ret = output_layers_choose(output, result, step);
+   if (ret != 0) return ret;
+
+   /* a search the budget didn't cut short is as good as exhaustive, and
+    * only those are worth remembering */
+   if (!result->budget_hit)
+     {
+        if (strategy != LIFTOFF_RPI_STRATEGY_ZPOS_DP)
+          output_search_tests_update(output, size,
+                                     dev->test_commit_counter -
+                                     result->tests_start);
+        if (result->best_score >= 0)
+          output_memo_store(output, result, signature);
+     }
+   else
+     {
+        ret = output_candidates_complete(output, result);
+        if (ret != 0) return ret;
+     }
+
+done:
+   output->stats.strategy = strategy;
+   output->stats.search_size = (uint32_t)size;
+   if (strategy < LIFTOFF_RPI_STATS_STRATEGIES_MAX)
+     output->stats.strategy_runs[strategy]++;
+
+   return 0;
+}
+
+static int
+output_search(struct liftoff_rpi_output *output, struct alloc_result *result, struct alloc_step *step, enum liftoff_rpi_strategy strategy)
+{
+   struct liftoff_rpi_device *dev;
+   size_t len;
+   int ret;
+
+   dev = output->dev;
+
+   alloc_search_init(output, result, step);
+
+   trace_begin(output->crtc_id, "output_layers_choose");
+   dump_search_begin(output);
+   ret = output_strategy_run(output, result, step, strategy);
+   dump_search_end(output, ret, result->best_score, dev->test_commit_counter);
+   dump_search_done(output);
+
+   if (ret == 0 && result->best_score < 0 && output->idle)
+     {
+        /* don't retry until one of the layers gets a new FB */
+        liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                        "Idle consolidation failed on output %p",
+                        (void *)output);
+        output->idle = false;
+        output->idle_reject = layers_fb_change_time_get(output, &len);
+
+        alloc_search_init(output, result, step);
+
+        dump_search_begin(output);
+        ret = output_strategy_run(output, result, step, strategy);
+        dump_search_end(output, ret, result->best_score,
+                        dev->test_commit_counter);
+        dump_search_done(output);
+     }
+
+   trace_end(output->crtc_id, "output_layers_choose",
+             "\"score\":%d,\"tests\":%d", result->best_score,
+             dev->test_commit_counter);
+
+   return ret;
+}
+
+/* Under deadline pressure, keeps the planes of the last allocation even
+ * though some layers changed in ways that normally call for a new search,
+ * as long as the allocation still follows the search's rules and passes a
+ * test commit. The output then reallocates on its next apply. */
+static int
+reuse_relaxed(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   struct alloc_result result = {0};
+   struct alloc_step step = {0};
+   size_t i = 0;
+   int cur, ret = -EINVAL;
+
+   dev = output->dev;
+   if (output->layers_changed) return -EINVAL;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (!layer->plane) continue;
+        if (!layer_visible_get(layer) || layer->force_comp ||
+            !plane_check_layer_fb(layer->plane, layer))
+          return -EINVAL;
+     }
+
+   result.planes_len = liftoff_rpi_list_length(&dev->planes);
+   result.best = malloc(result.planes_len * sizeof(*result.best));
+   step.alloc = malloc(result.planes_len * sizeof(*step.alloc));
+   if (!result.best || !step.alloc)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "malloc");
+        ret = -ENOMEM;
+        goto out;
+     }
+
+   result.has_comp_layer = (output->comp_layer != NULL);
+   result.non_comp_layers_len = non_comp_layers_len(output);
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        layer = plane->layer;
+        result.best[i++] = (layer && layer->output == output) ? layer : NULL;
+     }
+
+   alloc_step_init(output, &step);
+   if (!alloc_result_valid_get(output, &result, &step)) goto out;
+
+   cur = drmModeAtomicGetCursor(req);
+
+   ret = apply_current(output, req);
+   if (ret != 0) goto out;
+
+   ret = device_test_commit(dev, req, flags);
+   trace_test_commit(output, NULL, NULL, ret);
+   if (ret != 0) drmModeAtomicSetCursor(req, cur);
+
+out:
+   free(result.best);
+   free(step.alloc);
+   return ret;
+}
+
+/* Device wide reallocation staggering
+ *
+ * Test commits of all outputs go through the same fd and serialize, so
+ * when an event invalidates every output at once only one of them gets to
+ * run a full search per window. The others keep their previous planes, or
+ * fall back to composition, and try again on their next apply. An output
+ * is deferred at most LIFTOFF_RPI_STAGGER_MAX times in a row. */
+
+static int64_t
+output_priority_get(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_layer *layer;
+   int64_t priority = 0;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer->current_priority > priority)
+          priority = layer->current_priority;
+     }
+
+   return priority;
+}
+
+/* whether a should get the next full search before b */
+static bool
+output_more_urgent_get(struct liftoff_rpi_output *a, struct liftoff_rpi_output *b)
+{
+   if (a->stagger_deferred != b->stagger_deferred)
+     return a->stagger_deferred > b->stagger_deferred;
+
+   if (a->stagger_deadline >= 0 && b->stagger_deadline >= 0 &&
+       a->stagger_deadline != b->stagger_deadline)
+     return a->stagger_deadline < b->stagger_deadline;
+
+   return output_priority_get(a) > output_priority_get(b);
+}
+
+static bool
+device_stagger_allowed_get(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_output *other;
+   int64_t now;
+
+   dev = output->dev;
+   if (!dev->stagger_window) return true;
+
+   output->stagger_deadline = output->deadline_budget;
+   if (output->stagger_deferred >= LIFTOFF_RPI_STAGGER_MAX) return true;
+
+   now = timing_now_get();
+   if (dev->stagger_owner && now - dev->stagger_start >= dev->stagger_window)
+     dev->stagger_owner = NULL;
+
+   if (dev->stagger_owner)
+     return dev->stagger_owner == output;
+
+   /* leave the window to an output that has been waiting longer */
+   liftoff_rpi_list_for_each(other, &dev->outputs, link)
+     {
+        if (other != output && other->stagger_deferred > 0 &&
+            output_more_urgent_get(other, output))
+          return false;
+     }
+
+   dev->stagger_owner = output;
+   dev->stagger_start = now;
+   return true;
+}
+
+/* puts every layer of the output in composition */
+static int
+output_composite_all(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_plane *plane, *primary = NULL;
+   struct liftoff_rpi_layer *layer;
+   int cur, ret = 0;
+
+   dev = output->dev;
+   layer = output->comp_layer;
+   if (!layer || !layer_visible_get(layer)) return -EINVAL;
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        if (plane->type != DRM_PLANE_TYPE_PRIMARY) continue;
+        if ((plane->possible_crtcs & (1 << output->crtc_index)) == 0)
+          continue;
+        if (plane->layer && plane->layer->output != output) continue;
+        primary = plane;
+        break;
+     }
+
+   if (!primary || !plane_check_layer_fb(primary, layer)) return -EINVAL;
+
+   cur = drmModeAtomicGetCursor(req);
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        if (plane == primary)
+          ret = plane_apply(plane, layer, req);
+        else if (plane->layer && plane->layer->output == output)
+          ret = plane_apply(plane, NULL, req);
+        if (ret != 0) break;
+     }
+
+   if (ret == 0 && output->zpos_free)
+     ret = plane_zpos_set(primary, req, output->zpos_min);
+   if (ret == 0)
+     {
+        ret = device_test_commit(dev, req, flags);
+        trace_test_commit(output, primary, layer, ret);
+     }
+
+   if (ret != 0)
+     {
+        drmModeAtomicSetCursor(req, cur);
+        return ret;
+     }
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        if (plane->layer && plane->layer->output == output)
+          {
+             plane->layer->plane = NULL;
+             plane->layer = NULL;
+          }
+     }
+
+   primary->layer = layer;
+   layer->plane = primary;
+
+   return 0;
+}
+
+static int
+output_stagger_hold(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags)
+{
+   if (reuse_relaxed(output, req, flags) == 0) return 0;
+   return output_composite_all(output, req, flags);
+}
+
+static int
+output_realloc(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   struct alloc_result result = {0};
+   struct alloc_step step = {0};
+   size_t i = 0, cand = 0;
+   const char *type = NULL;
+   int ret;
+
+   dev = output->dev;
+
+   log_no_reuse(output);
+
+   dev->test_commit_counter = 0;
+
+   output_log_layers(output);
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        if (plane->layer && plane->layer->output == output)
+          {
+             plane->layer->plane = NULL;
+             plane->layer = NULL;
+          }
+     }
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        if (plane->layer == NULL)
+          {
+             cand++;
+
+             liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                             "Disabling plane %"PRIu32, plane->id);
 
              ret = plane_apply(plane, NULL, req);
              /* assert(ret != -EINVAL); */
@@ -748,24 +2313,15 @@ liftoff_rpi_output_apply(struct liftoff_rpi_output *output, drmModeAtomicReq *re
    if (step.alloc == NULL || result.best == NULL)
      {
         liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "malloc");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out;
      }
 
-   result.best_score = -1;
-   memset(result.best, 0, result.planes_len * sizeof(*result.best));
    result.has_comp_layer = (output->comp_layer != NULL);
    result.non_comp_layers_len = non_comp_layers_len(output);
 
-   step.plink = dev->planes.next;
-   step.pindex = 0;
-   step.score = 0;
-   step.last_layer_zpos = INT_MAX;
-   step.primary_layer_zpos = INT_MIN;
-   step.primary_plane_zpos = INT_MAX;
-   step.composited = false;
-
-   ret = output_layers_choose(output, &result, &step);
-   if (ret != 0) return ret;
+   ret = output_search(output, &result, &step, output->strategy);
+   if (ret != 0) goto out;
 
    liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
                    "Found plane allocation for output %p (score: %d, candidate planes: %zu, tests: %d):",
@@ -805,12 +2361,206 @@ liftoff_rpi_output_apply(struct liftoff_rpi_output *output, drmModeAtomicReq *re
      liftoff_rpi_log(LIFTOFF_RPI_DEBUG, "No layer has a plane");
 
    ret = apply_current(output, req);
-   if (ret != 0) return ret;
 
+out:
    free(step.alloc);
    free(result.best);
+   return ret;
+}
+
+static void
+output_zpos_free_update(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_plane *plane;
+   uint64_t min, max;
+   bool zpos_free;
+
+   output->zpos_min = 0;
+   output->zpos_max = UINT64_MAX;
+
+   zpos_free = output->zpos_mutable;
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (!zpos_free) break;
+        if ((plane->possible_crtcs & (1 << output->crtc_index)) == 0)
+          continue;
+        zpos_free = plane_zpos_mutable_get(plane);
+        if (!zpos_free) break;
+
+        plane_zpos_range_get(plane, &min, &max);
+        if (min > output->zpos_min) output->zpos_min = min;
+        if (max < output->zpos_max) output->zpos_max = max;
+     }
+   if (output->zpos_min > output->zpos_max) zpos_free = false;
+
+   if (zpos_free == output->zpos_free) return;
+
+   /* the previous allocation was made under other rules */
+   output->zpos_free = zpos_free;
+   output->layers_changed = true;
+   memo_fini(output);
+}
+
+static int
+output_apply(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags, bool *noop, int64_t deadline, bool *met)
+{
+   struct liftoff_rpi_device *dev;
+   const char *kind;
+   uint64_t tests;
+   int64_t start = 0, margin = 0;
+   bool pressure = false;
+   int ret;
+
+   dev = output->dev;
+   tests = dev->test_commits;
+
+   trace_begin(output->crtc_id, "liftoff_rpi_output_apply");
+
+   /* test commits are only timed for the budgets, traces and dumps */
+   dev->test_commit_timed = (deadline != 0 || trace_enabled() ||
+                             dump_enabled(output) ||
+                             output->strategy == LIFTOFF_RPI_STRATEGY_AUTO ||
+                             output->strategy == LIFTOFF_RPI_STRATEGY_BOUNDED);
+
+   /* leave time for the real commit, which costs about a test commit, and
+    * a quarter of the rest for the work around the search */
+   output->deadline_budget = -1;
+   if (deadline)
+     {
+        margin = dev->test_commit_avg;
+        output->deadline_budget = deadline - timing_now_get() - margin;
+        output->deadline_budget = output->deadline_budget * 3 / 4;
+        if (output->deadline_budget < 0) output->deadline_budget = 0;
+        pressure = (output->deadline_budget < output->search_budget);
+     }
+
+   damage_blobs_release(output);
+   layers_split_update(output);
+   layers_priority_update(dev);
+   layers_fb_update(output);
+   output_idle_update(output);
+   output_planes_reserve(output);
+   output_zpos_free_update(output);
+
+   if (noop)
+     {
+        *noop = output_noop_get(output);
+        if (*noop)
+          {
+             liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                             "Output %p state unchanged since last apply",
+                             (void *)output);
+             log_reuse(output);
+             output_composition_update(output);
+             kind = "noop";
+             output->stats.noops++;
+             ret = 0;
+             goto out;
+          }
+     }
+
+   trace_begin(output->crtc_id, "reuse_prev_alloc");
+   ret = reuse_prev_alloc(output, req, flags);
+   trace_end(output->crtc_id, "reuse_prev_alloc", "\"ret\":%d", ret);
+   if (ret == 0)
+     {
+        log_reuse(output);
+        kind = "reuse";
+        output->stats.reuses++;
+     }
+   else if (pressure && reuse_relaxed(output, req, flags) == 0)
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                        "Deadline close, keeping the allocation of "
+                        "output %p for now", (void *)output);
+        kind = "relaxed";
+        output->stats.reuses++;
+        output->stats.relaxed_reuses++;
+        output->realloc_deferred = true;
+        ret = 0;
+     }
+   else if (!device_stagger_allowed_get(output) &&
+            output_stagger_hold(output, req, flags) == 0)
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                        "Another output is reallocating, deferring "
+                        "output %p", (void *)output);
+        kind = "deferred";
+        output->stats.stagger_deferrals++;
+        output->stagger_deferred++;
+        output->realloc_deferred = true;
+        ret = 0;
+     }
+   else
+     {
+        kind = "realloc";
+        output->stats.reallocs++;
+        start = timing_now_get();
+        ret = output_realloc(output, req, flags);
+        if (ret != 0)
+          {
+             kind = "error";
+             output->stats.errors++;
+             goto out;
+          }
+        output->realloc_deferred = false;
+        output->stagger_deferred = 0;
+     }
 
+   output_composition_update(output);
+   /* whatever kept or found the allocation, the next apply compares
+    * against this frame: the no-op and composition checks need it */
    layers_mark_clean(output);
+   output->applied = true;
 
-   return 0;
+out:
+   output->deadline_budget = -1;
+   if (deadline)
+     {
+        output->stats.deadline_applies++;
+        if (timing_now_get() + margin > deadline)
+          {
+             output->stats.deadline_misses++;
+             if (met) *met = false;
+          }
+        else if (met)
+          *met = true;
+     }
+
+   stats_output_apply_record(output, dev->test_commits - tests,
+                             start ? timing_now_get() - start : 0);
+
+   trace_end(output->crtc_id, "liftoff_rpi_output_apply",
+             "\"result\":\"%s\"", kind);
+   trace_counter(output->crtc_id, "test commits",
+                 (int64_t)(dev->test_commits - tests));
+   trace_counter(output->crtc_id, "layers composited",
+                 output->stats.layers_composited);
+
+   return ret;
+}
+
+int
+liftoff_rpi_output_apply(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags)
+{
+   return output_apply(output, req, flags, NULL, 0, NULL);
+}
+
+int
+liftoff_rpi_output_apply_noop(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags, bool *noop)
+{
+   return output_apply(output, req, flags, noop, 0, NULL);
+}
+
+int
+liftoff_rpi_output_apply_deadline(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags, int64_t deadline, bool *met)
+{
+   return output_apply(output, req, flags, NULL, deadline, met);
+}
+
+void
+liftoff_rpi_device_realloc_stagger_set(struct liftoff_rpi_device *dev, unsigned int window_us)
+{
+   dev->stagger_window = (int64_t)window_us * 1000;
+   dev->stagger_owner = NULL;
 }
@@ -0,0 +1,166 @@
+#include "private.h"
+
+/* FB_DAMAGE_CLIPS blobs created for liftoff_rpi_layer_damage_set. A blob is
+ * kept while the layer's damage stays the same. A replaced blob may still
+ * be in the request of the last apply, so it is only destroyed once
+ * LIFTOFF_RPI_DAMAGE_DELAY more applies went by, by when the commit that
+ * used it has been made and the kernel holds its own reference. */
+
+static void
+damage_blob_retire(struct liftoff_rpi_output *output, uint32_t blob)
+{
+   struct liftoff_rpi_damage_blob *retired;
+
+   if (!blob) return;
+
+   if (output->damage_retired_len == output->damage_retired_cap)
+     {
+        retired = realloc(output->damage_retired,
+                          (output->damage_retired_cap + 8) * sizeof(*retired));
+        if (!retired)
+          {
+             /* leaking the blob beats pulling it from under a commit */
+             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "realloc");
+             return;
+          }
+        output->damage_retired = retired;
+        output->damage_retired_cap += 8;
+     }
+
+   retired = &output->damage_retired[output->damage_retired_len++];
+   retired->id = blob;
+   retired->serial = output->damage_serial;
+}
+
+/* local functions */
+void
+damage_layer_forget(struct liftoff_rpi_layer *layer)
+{
+   damage_blob_retire(layer->output, layer->damage_blob);
+   layer->damage_blob = 0;
+   layer->damage_len = 0;
+}
+
+void
+damage_blobs_release(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_damage_blob *retired;
+   size_t i = 0, kept = 0;
+
+   output->damage_serial++;
+
+   for (; i < output->damage_retired_len; i++)
+     {
+        retired = &output->damage_retired[i];
+        if (output->damage_serial - retired->serial > LIFTOFF_RPI_DAMAGE_DELAY)
+          drmModeDestroyPropertyBlob(output->dev->fd, retired->id);
+        else
+          output->damage_retired[kept++] = *retired;
+     }
+
+   output->damage_retired_len = kept;
+}
+
+void
+damage_layer_fini(struct liftoff_rpi_layer *layer)
+{
+   damage_layer_forget(layer);
+   free(layer->damage);
+   layer->damage = NULL;
+   layer->damage_cap = 0;
+}
+
+void
+damage_output_fini(struct liftoff_rpi_output *output)
+{
+   size_t i = 0;
+
+   for (; i < output->damage_retired_len; i++)
+     drmModeDestroyPropertyBlob(output->dev->fd,
+                                output->damage_retired[i].id);
+
+   free(output->damage_retired);
+   output->damage_retired = NULL;
+   output->damage_retired_len = 0;
+   output->damage_retired_cap = 0;
+}
+
+/* API functions */
+int
+liftoff_rpi_layer_damage_set(struct liftoff_rpi_layer *layer, const struct drm_mode_rect *rects, size_t rects_len)
+{
+   struct drm_mode_rect *damage, bounds;
+   size_t i = 1;
+   uint32_t blob, old;
+   int ret;
+
+   if (!rects || !rects_len)
+     {
+        /* the whole FB is damaged */
+        damage_layer_forget(layer);
+        liftoff_rpi_layer_property_unset(layer, LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS);
+        return 0;
+     }
+
+   /* drivers walk every clip, past a few the bounds do as well */
+   if (rects_len > LIFTOFF_RPI_DAMAGE_RECTS_MAX)
+     {
+        bounds = rects[0];
+        for (; i < rects_len; i++)
+          {
+             if (rects[i].x1 < bounds.x1) bounds.x1 = rects[i].x1;
+             if (rects[i].y1 < bounds.y1) bounds.y1 = rects[i].y1;
+             if (rects[i].x2 > bounds.x2) bounds.x2 = rects[i].x2;
+             if (rects[i].y2 > bounds.y2) bounds.y2 = rects[i].y2;
+          }
+        rects = &bounds;
+        rects_len = 1;
+     }
+
+   if (layer->damage_blob && layer->damage_len == rects_len &&
+       !memcmp(layer->damage, rects, rects_len * sizeof(*rects)))
+     return 0;
+
+   if (layer->damage_cap < rects_len)
+     {
+        damage = realloc(layer->damage, rects_len * sizeof(*damage));
+        if (!damage)
+          {
+             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "realloc");
+             return -ENOMEM;
+          }
+        layer->damage = damage;
+        layer->damage_cap = rects_len;
+     }
+
+   ret = drmModeCreatePropertyBlob(layer->output->dev->fd, rects,
+                                   rects_len * sizeof(*rects), &blob);
+   if (ret != 0)
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_ERROR, "drmModeCreatePropertyBlob: %s",
+                        strerror(-ret));
+        return ret;
+     }
+
+   /* the property keeps pointing at the old blob until the set succeeds,
+    * so only retire it then */
+   old = layer->damage_blob;
+   layer->damage_blob = 0;
+
+   ret = liftoff_rpi_layer_property_set(layer,
+                                        LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS, blob);
+   if (ret != 0)
+     {
+        layer->damage_blob = old;
+        drmModeDestroyPropertyBlob(layer->output->dev->fd, blob);
+        return ret;
+     }
+
+   damage_blob_retire(layer->output, old);
+
+   memcpy(layer->damage, rects, rects_len * sizeof(*rects));
+   layer->damage_len = rects_len;
+   layer->damage_blob = blob;
+
+   return 0;
+}
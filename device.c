@@ -7,6 +7,10 @@ device_test_commit(struct liftoff_rpi_device *dev, drmModeAtomicReq *req, uint32
    int ret;
 
    dev->test_commit_counter++;
+   dev->test_commits++;
+
+   if (dev->test_commit_timed)
+     dev->test_commit_start = timing_now_get();
 
    flags &= ~(uint32_t)DRM_MODE_PAGE_FLIP_EVENT;
    do
@@ -15,6 +19,17 @@ device_test_commit(struct liftoff_rpi_device *dev, drmModeAtomicReq *req, uint32
                                   DRM_MODE_ATOMIC_TEST_ONLY | flags, NULL);
      } while (ret == -EINTR || ret == -EAGAIN);
 
+   if (dev->test_commit_timed)
+     {
+        dev->test_commit_time = timing_now_get() - dev->test_commit_start;
+
+        if (dev->test_commit_avg == 0)
+          dev->test_commit_avg = dev->test_commit_time;
+        else
+          dev->test_commit_avg +=
+            (dev->test_commit_time - dev->test_commit_avg) / 8;
+     }
+
    /* The kernel will return -EINVAL for invalid configuration, -ERANGE for
     * CRTC coords overflow, and -ENOSPC for invalid SRC coords. */
    if (ret != 0 && ret != -EINVAL && ret != -ERANGE && ret != -ENOSPC)
@@ -26,6 +41,57 @@ device_test_commit(struct liftoff_rpi_device *dev, drmModeAtomicReq *req, uint32
    return ret;
 }
 
+/* Planes are created in kernel ID order but walked in list order, primaries
+ * first then by descending zpos. Moves them and their props into blocks laid
+ * out in list order. Planes stay where they are if memory runs out. */
+static void
+device_planes_pack(struct liftoff_rpi_device *dev)
+{
+   struct liftoff_rpi_slab slab;
+   struct liftoff_rpi_plane *plane, *tmp, *packed;
+   struct liftoff_rpi_property *props;
+   size_t planes_len = 0, props_len = 0;
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        planes_len++;
+        props_len += plane->props_len;
+     }
+   if (planes_len == 0) return;
+
+   props = calloc(props_len > 0 ? props_len : 1, sizeof(*props));
+   if (!props) return;
+
+   liftoff_rpi_slab_init(&slab, sizeof(struct liftoff_rpi_plane), planes_len);
+   dev->planes_props = props;
+
+   liftoff_rpi_list_for_each_safe(plane, tmp, &dev->planes, link)
+     {
+        /* one chunk holds them all, so this can only fail on the first */
+        packed = liftoff_rpi_slab_alloc(&slab);
+        if (!packed)
+          {
+             liftoff_rpi_slab_fini(&slab);
+             free(dev->planes_props);
+             dev->planes_props = NULL;
+             return;
+          }
+
+        *packed = *plane;
+        memcpy(props, plane->props, plane->props_len * sizeof(*props));
+        free(plane->props);
+        packed->props = props;
+        packed->props_packed = true;
+        props += plane->props_len;
+
+        liftoff_rpi_list_insert(plane->link.prev, &packed->link);
+        liftoff_rpi_list_remove(&plane->link);
+     }
+
+   liftoff_rpi_slab_fini(&dev->planes_slab);
+   dev->planes_slab = slab;
+}
+
 /* API functions */
 struct liftoff_rpi_device *
 liftoff_rpi_device_create(int fd)
@@ -43,6 +109,7 @@ liftoff_rpi_device_create(int fd)
 
    liftoff_rpi_list_init(&dev->planes);
    liftoff_rpi_list_init(&dev->outputs);
+   liftoff_rpi_list_init(&dev->fbs);
 
    dev->fd = dup(fd);
    if (dev->fd < 0)
@@ -72,6 +139,11 @@ liftoff_rpi_device_create(int fd)
 
    memcpy(dev->crtcs, res->crtcs, dev->crtcs_len * sizeof(dev->crtcs[0]));
 
+   dev->min_width = res->min_width;
+   dev->max_width = res->max_width;
+   dev->min_height = res->min_height;
+   dev->max_height = res->max_height;
+
    drmModeFreeResources(res);
 
    pres = drmModeGetPlaneResources(dev->fd);
@@ -85,6 +157,11 @@ liftoff_rpi_device_create(int fd)
    dev->planes_cap = pres->count_planes;
    drmModeFreePlaneResources(pres);
 
+   liftoff_rpi_slab_init(&dev->planes_slab, sizeof(struct liftoff_rpi_plane),
+                         dev->planes_cap);
+   liftoff_rpi_slab_init(&dev->outputs_slab, sizeof(struct liftoff_rpi_output),
+                         dev->crtcs_len);
+
    return dev;
 }
 
@@ -100,6 +177,12 @@ liftoff_rpi_device_destroy(struct liftoff_rpi_device *dev)
    liftoff_rpi_list_for_each_safe(plane, tmp, &dev->planes, link)
      liftoff_rpi_plane_destroy(plane);
 
+   stats_device_fini(dev);
+   fb_device_fini(dev);
+
+   liftoff_rpi_slab_fini(&dev->planes_slab);
+   liftoff_rpi_slab_fini(&dev->outputs_slab);
+   free(dev->planes_props);
    free(dev->crtcs);
    free(dev);
 }
@@ -109,6 +192,11 @@ liftoff_rpi_device_register_planes(struct liftoff_rpi_device *dev)
 {
    drmModePlaneRes *res;
    uint32_t i = 0;
+   bool pack;
+
+   /* nothing points at the planes yet, so they can still move */
+   pack = (liftoff_rpi_list_empty(&dev->planes) &&
+           liftoff_rpi_list_empty(&dev->outputs));
 
    res = drmModeGetPlaneResources(dev->fd);
    if (!res)
@@ -128,5 +216,7 @@ liftoff_rpi_device_register_planes(struct liftoff_rpi_device *dev)
      }
 
    drmModeFreePlaneResources(res);
+
+   if (pack) device_planes_pack(dev);
    return 0;
 }
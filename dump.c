@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include "private.h"
+
+/* JSON dump of the search tree explored by the next full allocations of an
+ * output. The file holds an array with one object per search:
+ *
+ *    {"crtc":N,"idle":B,"tree":NODE,"score":N,"tests":N}
+ *
+ * NODE is either a plane node
+ *
+ *    {"plane":N,"depth":N,"score":N,"tries":[TRY...],"skip":NODE,"ns":N}
+ *
+ * where each TRY is {"layer":"0x..","verdict":"..."}, with "ret" and
+ * "ioctl_ns" for layers that reached a test commit and "child":NODE for
+ * those that passed it, a node cut short by the bound or a group
+ *
+ *    {"plane":N,"depth":N,"score":N,"pruned":"bound"|"group"}
+ *
+ * or a leaf {"leaf":true,"score":N,"best":B}, where best is set if the
+ * leaf became the best valid allocation so far. */
+
+static void
+dump_close(struct liftoff_rpi_output *output)
+{
+   if (!output->dump_file) return;
+
+   fputs("\n]\n", output->dump_file);
+   fclose(output->dump_file);
+   output->dump_file = NULL;
+   output->dump_remaining = 0;
+}
+
+/* local functions */
+bool
+dump_enabled(struct liftoff_rpi_output *output)
+{
+   return output->dump_file != NULL;
+}
+
+void
+dump_search_begin(struct liftoff_rpi_output *output)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file, "%s\n{\"crtc\":%"PRIu32",\"idle\":%s,\"tree\":",
+           output->dump_first ? "" : ",", output->crtc_id,
+           output->idle ? "true" : "false");
+   output->dump_first = false;
+}
+
+void
+dump_search_end(struct liftoff_rpi_output *output, int ret, int score, int tests)
+{
+   if (!output->dump_file) return;
+
+   if (ret != 0)
+     {
+        /* the tree was left open, so the file can't be completed */
+        liftoff_rpi_log(LIFTOFF_RPI_ERROR,
+                        "Search dump truncated by error: %s", strerror(-ret));
+        fclose(output->dump_file);
+        output->dump_file = NULL;
+        output->dump_remaining = 0;
+        return;
+     }
+
+   fprintf(output->dump_file, ",\"score\":%d,\"tests\":%d}", score, tests);
+}
+
+void
+dump_search_done(struct liftoff_rpi_output *output)
+{
+   if (!output->dump_file) return;
+
+   output->dump_remaining--;
+   if (output->dump_remaining == 0) dump_close(output);
+}
+
+void
+dump_node_begin(struct liftoff_rpi_output *output, struct liftoff_rpi_plane *plane, size_t depth, int score)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file,
+           "{\"plane\":%"PRIu32",\"depth\":%zu,\"score\":%d,\"tries\":[",
+           plane->id, depth, score);
+}
+
+void
+dump_node_skip(struct liftoff_rpi_output *output)
+{
+   if (!output->dump_file) return;
+
+   fputs("],\"skip\":", output->dump_file);
+}
+
+void
+dump_node_end(struct liftoff_rpi_output *output, int64_t start)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file, ",\"ns\":%"PRId64"}", timing_now_get() - start);
+}
+
+void
+dump_node_pruned(struct liftoff_rpi_output *output, struct liftoff_rpi_plane *plane, size_t depth, int score, const char *why)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file,
+           "{\"plane\":%"PRIu32",\"depth\":%zu,\"score\":%d,"
+           "\"pruned\":\"%s\"}", plane->id, depth, score, why);
+}
+
+void
+dump_leaf(struct liftoff_rpi_output *output, int score, bool best)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file, "{\"leaf\":true,\"score\":%d,\"best\":%s}",
+           score, best ? "true" : "false");
+}
+
+void
+dump_try(struct liftoff_rpi_output *output, bool *first, struct liftoff_rpi_layer *layer, const char *verdict)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file, "%s{\"layer\":\"%p\",\"verdict\":\"%s\"}",
+           *first ? "" : ",", (void *)layer, verdict);
+   *first = false;
+}
+
+/* a passed test commit leaves the try open for its child, closed by
+ * dump_try_end */
+void
+dump_try_test(struct liftoff_rpi_output *output, bool *first, struct liftoff_rpi_layer *layer, int ret)
+{
+   if (!output->dump_file) return;
+
+   fprintf(output->dump_file,
+           "%s{\"layer\":\"%p\",\"verdict\":\"%s\",\"ret\":%d,"
+           "\"ioctl_ns\":%"PRId64"%s", *first ? "" : ",", (void *)layer,
+           ret == 0 ? "ok" : "rejected", ret, output->dev->test_commit_time,
+           ret == 0 ? ",\"child\":" : "}");
+   *first = false;
+}
+
+void
+dump_try_end(struct liftoff_rpi_output *output)
+{
+   if (!output->dump_file) return;
+
+   fputs("}", output->dump_file);
+}
+
+/* API functions */
+int
+liftoff_rpi_output_search_dump_set(struct liftoff_rpi_output *output, const char *path, unsigned int count)
+{
+   dump_close(output);
+
+   if (!path || !count) return 0;
+
+   output->dump_file = fopen(path, "w");
+   if (!output->dump_file)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "fopen");
+        return -errno;
+     }
+
+   fputs("[", output->dump_file);
+   output->dump_first = true;
+   output->dump_remaining = count;
+
+   return 0;
+}
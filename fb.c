@@ -0,0 +1,163 @@
+#include "private.h"
+
+/* FB descriptors. The allocator only looks at an FB's size, format,
+ * modifier and flags, so a layer points at a descriptor holding just
+ * those instead of keeping the drmModeFB2 around. Descriptors are
+ * interned per device: FBs alike share one, whatever their ID, and a
+ * layer whose FB changed for a like one still points at the same
+ * descriptor. Comparing the pointers is enough to tell. */
+
+static struct liftoff_rpi_fb *
+fb_intern(struct liftoff_rpi_device *dev, const drmModeFB2 *info)
+{
+   struct liftoff_rpi_fb *fb;
+
+   liftoff_rpi_list_for_each(fb, &dev->fbs, link)
+     {
+        if (fb->width == info->width && fb->height == info->height &&
+            fb->pixel_format == info->pixel_format &&
+            fb->modifier == info->modifier && fb->flags == info->flags)
+          {
+             fb->refs++;
+             return fb;
+          }
+     }
+
+   fb = calloc(1, sizeof(*fb));
+   if (!fb)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
+        return NULL;
+     }
+
+   fb->width = info->width;
+   fb->height = info->height;
+   fb->pixel_format = info->pixel_format;
+   fb->modifier = info->modifier;
+   fb->flags = info->flags;
+   fb->refs = 1;
+   liftoff_rpi_list_insert(&dev->fbs, &fb->link);
+
+   return fb;
+}
+
+static void
+fb_unref(struct liftoff_rpi_fb *fb)
+{
+   if (!fb) return;
+
+   if (--fb->refs > 0) return;
+
+   liftoff_rpi_list_remove(&fb->link);
+   free(fb);
+}
+
+static void
+fb_handles_close(int fd, drmModeFB2 *info)
+{
+   size_t i = 0, j = 0, num_planes;
+   int ret;
+
+   /* drmModeGetFB2() always creates new GEM handles -- close these, we
+    * won't use them and we don't want to leak them */
+   num_planes = sizeof(info->handles) / sizeof(info->handles[0]);
+   for (; i < num_planes; i++)
+     {
+        if (info->handles[i] == 0)
+          continue;
+
+        ret = drmCloseBufferHandle(fd, info->handles[i]);
+        if (ret != 0)
+          {
+             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmCloseBufferHandle");
+             continue;
+          }
+
+        /* Make sure we don't double-close a handle */
+        for (j = i + 1; j < num_planes; j++)
+          {
+             if (info->handles[j] == info->handles[i])
+               info->handles[j] = 0;
+          }
+        info->handles[i] = 0;
+     }
+}
+
+/* local functions */
+int
+fb_layer_update(struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_property *fb_id_prop;
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_fb *fb;
+   drmModeFB2 *info;
+   int ret;
+
+   dev = layer->output->dev;
+
+   fb_id_prop = layer_property_get(layer, LIFTOFF_RPI_PROP_FB_ID);
+   if (!fb_id_prop || fb_id_prop->value == 0)
+     {
+        fb_unref(layer->fb);
+        layer->fb = NULL;
+        layer->fb_id = 0;
+        return 0;
+     }
+
+   if (layer->fb && layer->fb_id == fb_id_prop->value)
+     return 0;
+
+   info = drmModeGetFB2(dev->fd, fb_id_prop->value);
+   if (!info)
+     {
+        ret = errno == EINVAL ? 0 : -errno;
+        fb_unref(layer->fb);
+        layer->fb = NULL;
+        layer->fb_id = 0;
+        return ret;
+     }
+
+   fb_handles_close(dev->fd, info);
+
+   fb = fb_intern(dev, info);
+   drmModeFreeFB2(info);
+
+   fb_unref(layer->fb);
+   layer->fb = fb;
+   layer->fb_id = fb ? (uint32_t)fb_id_prop->value : 0;
+
+   return fb ? 0 : -ENOMEM;
+}
+
+void
+fb_layer_clean(struct liftoff_rpi_layer *layer)
+{
+   if (layer->prev_fb == layer->fb) return;
+
+   fb_unref(layer->prev_fb);
+   layer->prev_fb = layer->fb;
+   if (layer->prev_fb) layer->prev_fb->refs++;
+}
+
+void
+fb_layer_fini(struct liftoff_rpi_layer *layer)
+{
+   fb_unref(layer->fb);
+   fb_unref(layer->prev_fb);
+   layer->fb = NULL;
+   layer->prev_fb = NULL;
+   layer->fb_id = 0;
+}
+
+void
+fb_device_fini(struct liftoff_rpi_device *dev)
+{
+   struct liftoff_rpi_fb *fb, *tmp;
+
+   /* layers of outputs the caller never destroyed */
+   liftoff_rpi_list_for_each_safe(fb, tmp, &dev->fbs, link)
+     {
+        liftoff_rpi_list_remove(&fb->link);
+        free(fb);
+     }
+}
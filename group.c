@@ -0,0 +1,88 @@
+#include "private.h"
+
+/* API functions */
+struct liftoff_rpi_layer_group *
+liftoff_rpi_layer_group_create(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_layer_group *group;
+
+   group = calloc(1, sizeof(*group));
+   if (!group)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
+        return NULL;
+     }
+
+   group->output = output;
+   group->serial = ++output->group_serial;
+   liftoff_rpi_list_insert(output->groups.prev, &group->link);
+   return group;
+}
+
+void
+liftoff_rpi_layer_group_destroy(struct liftoff_rpi_layer_group *group)
+{
+   size_t i = 0;
+
+   if (!group) return;
+
+   for (; i < group->layers_len; i++)
+     group->layers[i]->group = NULL;
+
+   if (group->layers_len > 0)
+     group->output->layers_changed = true;
+
+   liftoff_rpi_list_remove(&group->link);
+   free(group->layers);
+   free(group);
+}
+
+int
+liftoff_rpi_layer_group_layer_add(struct liftoff_rpi_layer_group *group, struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_layer **layers;
+
+   if (layer->output != group->output || layer->group != NULL)
+     {
+        liftoff_rpi_log(LIFTOFF_RPI_ERROR,
+                        "Layer %p cannot be added to group %p",
+                        (void *)layer, (void *)group);
+        return -EINVAL;
+     }
+
+   layers = realloc(group->layers,
+                    (group->layers_len + 1) * sizeof(group->layers[0]));
+   if (!layers)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "realloc");
+        return -ENOMEM;
+     }
+
+   group->layers = layers;
+   group->layers[group->layers_len++] = layer;
+   layer->group = group;
+
+   group->output->layers_changed = true;
+   return 0;
+}
+
+void
+liftoff_rpi_layer_group_layer_remove(struct liftoff_rpi_layer_group *group, struct liftoff_rpi_layer *layer)
+{
+   size_t i = 0;
+
+   if (layer->group != group) return;
+
+   for (; i < group->layers_len; i++)
+     {
+        if (group->layers[i] == layer)
+          break;
+     }
+
+   group->layers_len--;
+   memmove(&group->layers[i], &group->layers[i + 1],
+           (group->layers_len - i) * sizeof(group->layers[0]));
+   layer->group = NULL;
+
+   group->output->layers_changed = true;
+}
@@ -40,11 +40,45 @@ enum liftoff_rpi_property_name
    LIFTOFF_RPI_PROP_IN_FORMATS = 19,
 };
 
+/* How full reallocations search for an allocation. EXHAUSTIVE is the
+ * default. AUTO, which has to be asked for, picks one of the others for
+ * each search from the size of the scene and the measured cost of test
+ * commits. ZPOS_DP matches layers to fixed-zpos planes by dynamic
+ * programming; when that leaves layers out, it only bounds the
+ * exhaustive search, which may still find a better allocation. */
+enum liftoff_rpi_strategy
+{
+   LIFTOFF_RPI_STRATEGY_EXHAUSTIVE,
+   LIFTOFF_RPI_STRATEGY_BOUNDED,
+   LIFTOFF_RPI_STRATEGY_GREEDY,
+   LIFTOFF_RPI_STRATEGY_MEMOIZED,
+   LIFTOFF_RPI_STRATEGY_AUTO,
+   LIFTOFF_RPI_STRATEGY_ZPOS_DP,
+};
+
 struct liftoff_rpi_device;
 struct liftoff_rpi_output;
 struct liftoff_rpi_layer;
+struct liftoff_rpi_layer_group;
 struct liftoff_rpi_plane;
 struct liftoff_rpi_property;
+struct liftoff_rpi_stats_output;
+
+struct liftoff_rpi_layer_prop
+{
+   int property;
+   uint64_t value;
+};
+
+/* One layer of a scene passed to liftoff_rpi_output_scene_set. The key
+ * identifies the layer across frames. */
+struct liftoff_rpi_layer_desc
+{
+   uint64_t key;
+   const struct liftoff_rpi_layer_prop *props;
+   size_t props_len;
+   bool composition, fb_composited;
+};
 
 /* API log functions */
 typedef void (*liftoff_rpi_log_handler)(enum liftoff_rpi_log_priority priority,
@@ -53,17 +87,84 @@ typedef void (*liftoff_rpi_log_handler)(enum liftoff_rpi_log_priority priority,
 void liftoff_rpi_log_priority_set(enum liftoff_rpi_log_priority priority);
 void liftoff_rpi_log_handler_set(liftoff_rpi_log_handler handler);
 
+/* API trace functions
+ *
+ * Writes allocator events as a Chrome JSON trace, which ui.perfetto.dev can
+ * open. Pass NULL to finish and close the file. */
+int liftoff_rpi_trace_file_set(const char *path);
+
 /* API device functions */
 struct liftoff_rpi_device *liftoff_rpi_device_create(int fd);
 void liftoff_rpi_device_destroy(struct liftoff_rpi_device *dev);
 int liftoff_rpi_device_register_planes(struct liftoff_rpi_device *dev);
+/* Publishes per-output statistics in the named shared memory object, laid
+ * out as in libliftoff_rpi_stats.h. Pass NULL to remove it. */
+int liftoff_rpi_device_stats_publish(struct liftoff_rpi_device *dev, const char *name);
+/* Saves the CRTCs, planes and plane properties read from the kernel as
+ * text (see snapshot.c for the format). tests/mock.c loads it back. */
+int liftoff_rpi_device_snapshot_save(struct liftoff_rpi_device *dev, const char *path);
+/* Lets only one output run a full search per window (typically a frame
+ * period) while the others keep their previous allocation or composite.
+ * 0 disables it, which is the default. */
+void liftoff_rpi_device_realloc_stagger_set(struct liftoff_rpi_device *dev, unsigned int window_us);
 
 /* API output functions */
 struct liftoff_rpi_output *liftoff_rpi_output_create(struct liftoff_rpi_device *dev, uint32_t crtc_id);
+/* Layers of the output may still be destroyed after it, though not after
+ * the device. */
 void liftoff_rpi_output_destroy(struct liftoff_rpi_output *output);
 void liftoff_rpi_output_composition_layer_set(struct liftoff_rpi_output *output, struct liftoff_rpi_layer *layer);
 bool liftoff_rpi_output_needs_composition(struct liftoff_rpi_output *output);
+/* Region, in CRTC coordinates, the composition layer has to cover after
+ * the last apply: the composited layers and the layers on planes under
+ * it. The compositor may render only that and set the composition
+ * layer's SRC and CRTC rectangles to it. Returns false if nothing needs
+ * composition, or if the region is larger than the device's maximum FB
+ * size, in which case the whole composition layer is rendered. */
+bool liftoff_rpi_output_composition_rect_get(struct liftoff_rpi_output *output, int *x, int *y, int *w, int *h);
+bool liftoff_rpi_output_composition_unchanged_get(struct liftoff_rpi_output *output);
+void liftoff_rpi_output_idle_consolidation_set(struct liftoff_rpi_output *output, unsigned int secs);
+int liftoff_rpi_output_scene_set(struct liftoff_rpi_output *output, const struct liftoff_rpi_layer_desc *descs, size_t descs_len);
+struct liftoff_rpi_layer *liftoff_rpi_output_scene_layer_get(struct liftoff_rpi_output *output, uint64_t key);
+int liftoff_rpi_output_strategy_set(struct liftoff_rpi_output *output, enum liftoff_rpi_strategy strategy);
+/* Keeps min overlay planes for the output, even while it doesn't use them,
+ * and caps the non-primary planes it may use at max (-1 for no limit).
+ * Returns -EINVAL if min is above max. */
+int liftoff_rpi_output_plane_quota_set(struct liftoff_rpi_output *output, unsigned int min, int max);
+/* Lets the allocator swap optional properties a plane can't take for
+ * equivalent ones rather than composite the layer: SCALING_FILTER for the
+ * default filter, and the blend mode of an FB without alpha. Off by
+ * default. */
+void liftoff_rpi_output_relaxation_set(struct liftoff_rpi_output *output, bool enable);
+/* Programs the zpos of planes from the order of their layers instead of
+ * relying on their fixed stacking, so any free plane can take any layer.
+ * Only takes effect while all planes of the CRTC have a mutable zpos. Off
+ * by default. */
+void liftoff_rpi_output_zpos_mutable_set(struct liftoff_rpi_output *output, bool enable);
+/* Scans out layers whose source is wider than max_width pixels as strips
+ * side by side on separate planes, for planes with a limited width. The
+ * strips either all get a plane or the layer is composited. 0 disables
+ * it, which is the default. */
+void liftoff_rpi_output_layer_split_set(struct liftoff_rpi_output *output, unsigned int max_width);
+/* Time in µs a search may keep looking for a better allocation once it
+ * found a valid one, 2000 (2 ms) by default. Only the BOUNDED and AUTO
+ * strategies use it, AUTO also to pick the strategy it runs. The others
+ * only get a budget from liftoff_rpi_output_apply_deadline. */
+void liftoff_rpi_output_search_budget_set(struct liftoff_rpi_output *output, unsigned int usecs);
 int liftoff_rpi_output_apply(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags);
+/* Like liftoff_rpi_output_apply, but sets noop and leaves req untouched
+ * when nothing changed since the last apply (which the caller committed) */
+int liftoff_rpi_output_apply_noop(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags, bool *noop);
+/* Like liftoff_rpi_output_apply, but fits the search in the time left
+ * before deadline (CLOCK_MONOTONIC ns, as in page flip events), whatever
+ * the strategy. Sets met to whether there is still time left for the
+ * commit. */
+int liftoff_rpi_output_apply_deadline(struct liftoff_rpi_output *output, drmModeAtomicReq *req, uint32_t flags, int64_t deadline, bool *met);
+void liftoff_rpi_output_stats_get(struct liftoff_rpi_output *output, struct liftoff_rpi_stats_output *stats);
+/* Writes the next count search trees to path as JSON (see dump.c for the
+ * format). A reallocation retried after failed idle consolidation counts
+ * twice. Pass NULL to stop early. */
+int liftoff_rpi_output_search_dump_set(struct liftoff_rpi_output *output, const char *path, unsigned int count);
 
 /* API layer functions */
 struct liftoff_rpi_layer *liftoff_rpi_layer_create(struct liftoff_rpi_output *output);
@@ -71,9 +172,28 @@ void liftoff_rpi_layer_destroy(struct liftoff_rpi_layer *layer);
 bool liftoff_rpi_layer_needs_composition(struct liftoff_rpi_layer *layer);
 int liftoff_rpi_layer_property_set(struct liftoff_rpi_layer *layer, int property, uint64_t value);
 void liftoff_rpi_layer_property_unset(struct liftoff_rpi_layer *layer, int property);
+/* Sets FB_DAMAGE_CLIPS from rectangles in FB coordinates. The blob is
+ * created and destroyed by the library and kept while the damage doesn't
+ * change. Many rectangles get merged into their bounds. NULL marks the
+ * whole FB as damaged. */
+int liftoff_rpi_layer_damage_set(struct liftoff_rpi_layer *layer, const struct drm_mode_rect *rects, size_t rects_len);
 void liftoff_rpi_layer_fb_composited_set(struct liftoff_rpi_layer *layer);
 struct liftoff_rpi_plane *liftoff_rpi_layer_plane_get(struct liftoff_rpi_layer *layer);
 bool liftoff_rpi_layer_visible_get(struct liftoff_rpi_layer *layer);
+/* Whether the layer's plane got another value for property than the one
+ * set, see liftoff_rpi_output_relaxation_set */
+bool liftoff_rpi_layer_property_relaxed_get(struct liftoff_rpi_layer *layer, int property);
+
+/* API layer group functions
+ *
+ * The layers of a group either all get a plane or are all composited.
+ * Layers are added on top of the previously added ones and keep that
+ * relative order on planes. Groups left when their output is destroyed
+ * are destroyed with it. */
+struct liftoff_rpi_layer_group *liftoff_rpi_layer_group_create(struct liftoff_rpi_output *output);
+void liftoff_rpi_layer_group_destroy(struct liftoff_rpi_layer_group *group);
+int liftoff_rpi_layer_group_layer_add(struct liftoff_rpi_layer_group *group, struct liftoff_rpi_layer *layer);
+void liftoff_rpi_layer_group_layer_remove(struct liftoff_rpi_layer_group *group, struct liftoff_rpi_layer *layer);
 
 /* API plane functions */
 struct liftoff_rpi_plane *liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id);
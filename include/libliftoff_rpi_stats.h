@@ -0,0 +1,91 @@
+#ifndef LIFTOFF_RPI_STATS_H
+# define LIFTOFF_RPI_STATS_H
+
+# include <stdbool.h>
+# include <stdint.h>
+# include <string.h>
+
+/* Layout of the shared memory page published by
+ * liftoff_rpi_device_stats_publish. Readers map the page read-only and
+ * sample an output slot with liftoff_rpi_stats_output_read. */
+
+# define LIFTOFF_RPI_STATS_MAGIC 0x54534c4cu /* "LLST" */
+# define LIFTOFF_RPI_STATS_VERSION 1
+# define LIFTOFF_RPI_STATS_OUTPUTS_MAX 8
+# define LIFTOFF_RPI_STATS_HIST_LEN 24
+# define LIFTOFF_RPI_STATS_STRATEGIES_MAX 8
+
+struct liftoff_rpi_stats_output
+{
+   /* odd while the compositor is updating the slot */
+   uint32_t seq;
+   uint32_t crtc_id;
+
+   uint64_t applies;
+   uint64_t noops;
+   uint64_t reuses;
+   uint64_t reallocs;
+   uint64_t errors;
+
+   /* liftoff_rpi_output_apply_deadline calls, those that ran out of time
+    * and reuses of an outdated allocation to save time */
+   uint64_t deadline_applies;
+   uint64_t deadline_misses;
+   uint64_t relaxed_reuses;
+
+   /* full searches put off for another output's, see
+    * liftoff_rpi_device_realloc_stagger_set */
+   uint64_t stagger_deferrals;
+
+   uint64_t test_commits;
+   uint64_t search_time_ns;
+
+   /* from the last apply */
+   uint32_t layers;
+   uint32_t layers_composited;
+
+   /* enum liftoff_rpi_strategy used by the last full search, and the
+    * visible layers x usable planes it was picked for */
+   uint32_t strategy;
+   uint32_t search_size;
+   uint64_t strategy_runs[LIFTOFF_RPI_STATS_STRATEGIES_MAX];
+
+   /* bucket n counts applies in [2^(n-1), 2^n) */
+   uint64_t search_time_us_hist[LIFTOFF_RPI_STATS_HIST_LEN];
+   uint64_t test_commits_hist[LIFTOFF_RPI_STATS_HIST_LEN];
+};
+
+struct liftoff_rpi_stats_page
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t size;
+   uint32_t outputs_len;
+
+   struct liftoff_rpi_stats_output outputs[LIFTOFF_RPI_STATS_OUTPUTS_MAX];
+};
+
+/* Copies a consistent snapshot of slot into out. Returns false if the
+ * writer kept the slot busy for too long. */
+static inline bool
+liftoff_rpi_stats_output_read(const struct liftoff_rpi_stats_output *slot, struct liftoff_rpi_stats_output *out)
+{
+   uint32_t seq;
+   int tries = 0;
+
+   for (; tries < 1000; tries++)
+     {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+
+        memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+          return true;
+     }
+
+   return false;
+}
+
+#endif
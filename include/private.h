@@ -3,6 +3,7 @@
 
 /* standard includes */
 # include <errno.h>
+# include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
 # include <unistd.h>
@@ -11,10 +12,53 @@
 # include <sys/types.h>
 
 # include <libliftoff_rpi.h>
+# include <libliftoff_rpi_stats.h>
 # include "log.h"
 # include "list.h"
+# include "slab.h"
 
 # define LIFTOFF_RPI_PRIORITY_PERIOD 60
+# define LIFTOFF_RPI_MEMO_LEN 8
+# define LIFTOFF_RPI_SEARCH_SIZES 16
+# define LIFTOFF_RPI_STAGGER_MAX 3
+# define LIFTOFF_RPI_SPLIT_MAX 4
+# define LIFTOFF_RPI_DAMAGE_RECTS_MAX 16
+# define LIFTOFF_RPI_DAMAGE_DELAY 1
+# define LIFTOFF_RPI_PROPS_SPARE 16
+
+/* why a layer ended up composited during the last search */
+enum liftoff_rpi_comp_reason
+{
+   LIFTOFF_RPI_COMP_FORCE = 1 << 0,
+   LIFTOFF_RPI_COMP_FB = 1 << 1,
+   LIFTOFF_RPI_COMP_PROPS = 1 << 2,
+   LIFTOFF_RPI_COMP_ZPOS = 1 << 3,
+   LIFTOFF_RPI_COMP_GROUP = 1 << 4,
+   LIFTOFF_RPI_COMP_TEST = 1 << 5,
+};
+
+struct liftoff_rpi_memo_entry
+{
+   uint64_t signature;
+   int16_t *planes;
+   size_t planes_len;
+};
+
+struct liftoff_rpi_damage_blob
+{
+   uint32_t id;
+   uint64_t serial;
+};
+
+/* what the allocator needs to know about an FB, see fb.c */
+struct liftoff_rpi_fb
+{
+   struct liftoff_rpi_list link;
+   uint64_t modifier;
+   uint32_t width, height;
+   uint32_t pixel_format, flags;
+   unsigned int refs;
+};
 
 struct liftoff_rpi_device
 {
@@ -22,13 +66,41 @@ struct liftoff_rpi_device
 
    struct liftoff_rpi_list planes;
    struct liftoff_rpi_list outputs;
+   struct liftoff_rpi_list fbs;
+
+   struct liftoff_rpi_slab planes_slab;
+   struct liftoff_rpi_slab outputs_slab;
+
+   /* props of the planes packed by liftoff_rpi_device_register_planes */
+   struct liftoff_rpi_property *planes_props;
 
    uint32_t *crtcs;
    size_t crtcs_len;
 
+   uint32_t min_width, max_width;
+   uint32_t min_height, max_height;
+
    size_t planes_cap;
 
    int test_commit_counter, page_flip_counter;
+
+   uint64_t test_commits;
+   int64_t test_commit_start, test_commit_time;
+   int64_t test_commit_avg;
+   /* only set while something reads the timings, see output_apply */
+   bool test_commit_timed;
+
+   struct liftoff_rpi_stats_page *stats_page;
+   char *stats_name;
+
+   /* output that ran the last full search, see alloc.c */
+   struct liftoff_rpi_output *stagger_owner;
+   int64_t stagger_window, stagger_start;
+};
+
+struct liftoff_rpi_rect
+{
+   int x, y, w, h;
 };
 
 struct liftoff_rpi_output
@@ -36,14 +108,83 @@ struct liftoff_rpi_output
    struct liftoff_rpi_device *dev;
    struct liftoff_rpi_list link;
    struct liftoff_rpi_list layers;
+   struct liftoff_rpi_list groups;
    struct liftoff_rpi_layer *comp_layer;
 
+   /* layers are followed by their candidate_planes and relax_planes
+    * arrays */
+   struct liftoff_rpi_slab layers_slab;
+
    uint32_t crtc_id;
    size_t crtc_index;
 
    int alloc_reused_counter;
+   unsigned int scene_serial;
+
+   int64_t idle_timeout, idle_reject;
+
+   enum liftoff_rpi_strategy strategy;
+
+   /* time a full search may take, and test commits the exhaustive search
+    * needed, averaged by the bit length of visible layers x usable planes */
+   int64_t search_budget;
+   uint32_t search_tests[LIFTOFF_RPI_SEARCH_SIZES];
+
+   /* time left before the deadline of the current apply, or -1 */
+   int64_t deadline_budget;
+   bool realloc_deferred;
+
+   /* overlay planes kept for this output, and the most non-primary
+    * planes it may use (-1 for no limit) */
+   unsigned int plane_min;
+   int plane_max;
+
+   /* allow the substitutions of plane.c's relaxation table */
+   bool relax;
+
+   /* order planes by programming their zpos, zpos_free is set while all
+    * planes of the CRTC allow it, with the range they share */
+   bool zpos_mutable, zpos_free;
+   uint64_t zpos_min, zpos_max;
 
-   bool layers_changed;
+   /* source width above which layers get split, or 0 */
+   unsigned int split_width;
+
+   /* props arrays of destroyed layers, handed to new ones */
+   struct liftoff_rpi_property *props_spare[LIFTOFF_RPI_PROPS_SPARE];
+   uint32_t props_spare_cap[LIFTOFF_RPI_PROPS_SPARE];
+   size_t props_spare_len;
+
+   /* damage blobs waiting for the commits using them, see damage.c */
+   struct liftoff_rpi_damage_blob *damage_retired;
+   size_t damage_retired_len, damage_retired_cap;
+   uint64_t damage_serial;
+
+   /* last serial given to a group, see memo.c */
+   uint64_t group_serial;
+
+   unsigned int stagger_deferred;
+   int64_t stagger_deadline;
+
+   struct liftoff_rpi_memo_entry memo[LIFTOFF_RPI_MEMO_LEN];
+   size_t memo_next;
+
+   struct liftoff_rpi_stats_output stats;
+
+   /* search tree dump, see dump.c */
+   FILE *dump_file;
+   unsigned int dump_remaining;
+   bool dump_first;
+
+   /* what the composition layer has to cover, see
+    * liftoff_rpi_output_composition_rect_get */
+   struct liftoff_rpi_rect comp_rect;
+
+   bool layers_changed, applied, idle;
+   bool comp_dirty, comp_unchanged;
+
+   /* destroyed while the caller still held layers, freed with the last */
+   bool destroyed;
 };
 
 struct liftoff_rpi_layer
@@ -51,26 +192,67 @@ struct liftoff_rpi_layer
    struct liftoff_rpi_output *output;
    struct liftoff_rpi_list link;
    struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer_group *group;
    struct liftoff_rpi_property *props;
 
    uint32_t *candidate_planes;
+   uint32_t comp_reasons;
 
    int current_priority, pending_priority;
-   uint32_t props_len;
+   int64_t fb_change_time;
+   uint32_t props_len, props_cap;
+
+   uint64_t key;
+   unsigned int scene_serial;
+
+   /* IDs of the planes whose test commit only passed with relaxed values,
+    * 0 for unused slots */
+   uint32_t *relax_planes;
+
+   /* strips of a split layer, or the layer a strip belongs to. Strips
+    * left behind by a destroyed layer are orphans until the next apply */
+   struct liftoff_rpi_layer_group *split;
+   struct liftoff_rpi_layer *split_parent;
+   bool split_orphan;
+
+   /* rectangles of the damage blob we made, see damage.c */
+   struct drm_mode_rect *damage;
+   size_t damage_len, damage_cap;
+   uint32_t damage_blob;
 
    bool force_comp, changed;
+   bool composited, keyed;
+
+   /* NULL without an FB. fb_id is the FB fb was looked up for */
+   struct liftoff_rpi_fb *fb, *prev_fb;
+   uint32_t fb_id;
+};
 
-   drmModeFB2 fb_info, prev_fb_info;
+/* members are ordered bottom to top */
+struct liftoff_rpi_layer_group
+{
+   struct liftoff_rpi_output *output;
+   struct liftoff_rpi_list link;
+   struct liftoff_rpi_layer **layers;
+   size_t layers_len;
+
+   /* tells the group apart from an earlier one at the same address */
+   uint64_t serial;
 };
 
 struct liftoff_rpi_plane
 {
+   struct liftoff_rpi_device *dev;
    struct liftoff_rpi_list link;
    struct liftoff_rpi_layer *layer;
    struct liftoff_rpi_property *props;
 
+   /* output the plane is kept for, even while unused */
+   struct liftoff_rpi_output *reserved;
+
    drmModePropertyBlobRes *in_formats_blob;
    size_t props_len;
+   bool props_packed;
 
    uint32_t id, type;
    uint32_t possible_crtcs;
@@ -85,25 +267,78 @@ struct liftoff_rpi_property
    uint64_t value, prev_value;
 };
 
-struct liftoff_rpi_rect
-{
-   int x, y, w, h;
-};
+int64_t timing_now_get(void);
+
+bool trace_enabled(void);
+void trace_begin(uint32_t tid, const char *name);
+void trace_end(uint32_t tid, const char *name, const char *fmt, ...)
+_LIFTOFF_RPI_ATTRIB_PRINTF(3, 4);
+void trace_complete(uint32_t tid, const char *name, int64_t start, int64_t duration, const char *fmt, ...)
+_LIFTOFF_RPI_ATTRIB_PRINTF(5, 6);
+void trace_counter(uint32_t tid, const char *name, int64_t value);
+void trace_test_commit(struct liftoff_rpi_output *output, struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, int ret);
+
+void stats_output_publish(struct liftoff_rpi_output *output);
+void stats_output_apply_record(struct liftoff_rpi_output *output, uint64_t test_commits, int64_t search_time);
+void stats_device_fini(struct liftoff_rpi_device *dev);
+
+uint64_t memo_signature_get(struct liftoff_rpi_output *output);
+const int16_t *memo_lookup(struct liftoff_rpi_output *output, uint64_t signature, size_t planes_len);
+void memo_store(struct liftoff_rpi_output *output, uint64_t signature, const int16_t *planes, size_t planes_len);
+void memo_forget(struct liftoff_rpi_output *output, uint64_t signature);
+void memo_fini(struct liftoff_rpi_output *output);
+
+void damage_layer_forget(struct liftoff_rpi_layer *layer);
+void damage_blobs_release(struct liftoff_rpi_output *output);
+void damage_layer_fini(struct liftoff_rpi_layer *layer);
+void damage_output_fini(struct liftoff_rpi_output *output);
+
+int fb_layer_update(struct liftoff_rpi_layer *layer);
+void fb_layer_clean(struct liftoff_rpi_layer *layer);
+void fb_layer_fini(struct liftoff_rpi_layer *layer);
+void fb_device_fini(struct liftoff_rpi_device *dev);
+
+bool dump_enabled(struct liftoff_rpi_output *output);
+void dump_search_begin(struct liftoff_rpi_output *output);
+void dump_search_end(struct liftoff_rpi_output *output, int ret, int score, int tests);
+void dump_search_done(struct liftoff_rpi_output *output);
+void dump_node_begin(struct liftoff_rpi_output *output, struct liftoff_rpi_plane *plane, size_t depth, int score);
+void dump_node_skip(struct liftoff_rpi_output *output);
+void dump_node_end(struct liftoff_rpi_output *output, int64_t start);
+void dump_node_pruned(struct liftoff_rpi_output *output, struct liftoff_rpi_plane *plane, size_t depth, int score, const char *why);
+void dump_leaf(struct liftoff_rpi_output *output, int score, bool best);
+void dump_try(struct liftoff_rpi_output *output, bool *first, struct liftoff_rpi_layer *layer, const char *verdict);
+void dump_try_test(struct liftoff_rpi_output *output, bool *first, struct liftoff_rpi_layer *layer, int ret);
+void dump_try_end(struct liftoff_rpi_output *output);
 
 int device_test_commit(struct liftoff_rpi_device *dev, drmModeAtomicReq *req, uint32_t flags);
 
 bool layer_visible_get(struct liftoff_rpi_layer *layer);
 struct liftoff_rpi_property *layer_property_get(struct liftoff_rpi_layer *layer, int property);
+void layer_rect_get(struct liftoff_rpi_layer *layer, struct liftoff_rpi_rect *rect, bool prev);
+bool rect_intersects(const struct liftoff_rpi_rect *ra, const struct liftoff_rpi_rect *rb);
 bool layer_intersects(struct liftoff_rpi_layer *a, struct liftoff_rpi_layer *b);
 void layer_clean(struct liftoff_rpi_layer *layer);
 void layer_priority_update(struct liftoff_rpi_layer *layer, bool current);
 bool layer_fb_get(struct liftoff_rpi_layer *layer);
 void layer_candidate_plane_add(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane);
 void layer_candidate_planes_reset(struct liftoff_rpi_layer *layer);
-int layer_cache_fb_info(struct liftoff_rpi_layer *layer);
+bool layer_relax_plane_get(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane);
+void layer_relax_plane_add(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane);
+void layer_relax_plane_remove(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane);
+void layer_relax_planes_reset(struct liftoff_rpi_layer *layer);
+void layers_split_update(struct liftoff_rpi_output *output);
 
 int plane_apply(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, drmModeAtomicReq *req);
 bool plane_check_layer_fb(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer);
+uint32_t plane_relaxed_get(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer);
+bool plane_zpos_mutable_get(struct liftoff_rpi_plane *plane);
+void plane_zpos_range_get(struct liftoff_rpi_plane *plane, uint64_t *min, uint64_t *max);
+int plane_zpos_set(struct liftoff_rpi_plane *plane, drmModeAtomicReq *req, uint64_t value);
+bool plane_usable_get(struct liftoff_rpi_plane *plane, struct liftoff_rpi_output *output);
 void output_log_layers(struct liftoff_rpi_output *output);
+void output_planes_reserve(struct liftoff_rpi_output *output);
+void output_composition_update(struct liftoff_rpi_output *output);
+void output_free(struct liftoff_rpi_output *output);
 
 #endif
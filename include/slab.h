@@ -0,0 +1,20 @@
+#ifndef SLAB_H
+# define SLAB_H
+
+# include <stddef.h>
+
+/* Objects of one size, carved out of contiguous chunks and recycled through
+ * a free list. Objects never move, so handles to them stay valid. */
+struct liftoff_rpi_slab
+{
+   void *chunks;
+   void *free;
+   size_t obj_size, chunk_len;
+};
+
+void liftoff_rpi_slab_init(struct liftoff_rpi_slab *slab, size_t obj_size, size_t chunk_len);
+void liftoff_rpi_slab_fini(struct liftoff_rpi_slab *slab);
+void *liftoff_rpi_slab_alloc(struct liftoff_rpi_slab *slab);
+void liftoff_rpi_slab_free(struct liftoff_rpi_slab *slab, void *obj);
+
+#endif
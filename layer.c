@@ -15,6 +15,9 @@ layer_visible_get(struct liftoff_rpi_layer *layer)
 {
    struct liftoff_rpi_property *prop;
 
+   /* the strips stand in for it */
+   if (layer->split) return false;
+
    prop = layer_property_get(layer, LIFTOFF_RPI_PROP_ALPHA);
    if (prop && prop->value == 0)
      {
@@ -35,8 +38,8 @@ layer_visible_get(struct liftoff_rpi_layer *layer)
      }
 }
 
-static void
-layer_rect_get(struct liftoff_rpi_layer *layer, struct liftoff_rpi_rect *rect)
+void
+layer_rect_get(struct liftoff_rpi_layer *layer, struct liftoff_rpi_rect *rect, bool prev)
 {
    struct liftoff_rpi_property *xprop, *yprop, *wprop, *hprop;
 
@@ -45,12 +48,28 @@ layer_rect_get(struct liftoff_rpi_layer *layer, struct liftoff_rpi_rect *rect)
    wprop = layer_property_get(layer, LIFTOFF_RPI_PROP_CRTC_W);
    hprop = layer_property_get(layer, LIFTOFF_RPI_PROP_CRTC_H);
 
+   if (prev)
+     {
+        rect->x = (xprop != NULL ? xprop->prev_value : 0);
+        rect->y = (yprop != NULL ? yprop->prev_value : 0);
+        rect->w = (wprop != NULL ? wprop->prev_value : 0);
+        rect->h = (hprop != NULL ? hprop->prev_value : 0);
+        return;
+     }
+
    rect->x = (xprop != NULL ? xprop->value : 0);
    rect->y = (yprop != NULL ? yprop->value : 0);
    rect->w = (wprop != NULL ? wprop->value : 0);
    rect->h = (hprop != NULL ? hprop->value : 0);
 }
 
+bool
+rect_intersects(const struct liftoff_rpi_rect *ra, const struct liftoff_rpi_rect *rb)
+{
+   return ra->x < rb->x + rb->w && ra->y < rb->y + rb->h &&
+     ra->x + ra->w > rb->x && ra->y + ra->h > rb->y;
+}
+
 bool
 layer_intersects(struct liftoff_rpi_layer *a, struct liftoff_rpi_layer *b)
 {
@@ -59,11 +78,10 @@ layer_intersects(struct liftoff_rpi_layer *a, struct liftoff_rpi_layer *b)
    if (!layer_visible_get(a) || !layer_visible_get(b))
      return false;
 
-   layer_rect_get(a, &ra);
-   layer_rect_get(b, &rb);
+   layer_rect_get(a, &ra, false);
+   layer_rect_get(b, &rb, false);
 
-   return ra.x < rb.x + rb.w && ra.y < rb.y + rb.h &&
-     ra.x + ra.w > rb.x && ra.y + ra.h > rb.y;
+   return rect_intersects(&ra, &rb);
 }
 
 void
@@ -72,7 +90,7 @@ layer_clean(struct liftoff_rpi_layer *layer)
    size_t i = 0;
 
    layer->changed = false;
-   layer->prev_fb_info = layer->fb_info;
+   fb_layer_clean(layer);
    for (; i < layer->props_len; i++)
      layer->props[i].prev_value = layer->props[i].value;
 }
@@ -84,7 +102,10 @@ layer_priority_update(struct liftoff_rpi_layer *layer, bool current)
 
    prop = layer_property_get(layer, LIFTOFF_RPI_PROP_FB_ID);
    if (prop != NULL && prop->prev_value != prop->value)
-     layer->pending_priority++;
+     {
+        layer->pending_priority++;
+        layer->fb_change_time = timing_now_get();
+     }
 
    if (current)
      {
@@ -157,84 +178,316 @@ layer_candidate_planes_reset(struct liftoff_rpi_layer *layer)
           sizeof(layer->candidate_planes[0]) * layer->output->dev->planes_cap);
 }
 
-int
-layer_cache_fb_info(struct liftoff_rpi_layer *layer)
+bool
+layer_relax_plane_get(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane)
 {
-   struct liftoff_rpi_property *fb_id_prop;
-   drmModeFB2 *fb_info;
-   size_t i = 0, j = 0, num_planes;
-   int ret;
+   size_t i = 0;
+
+   for (; i < layer->output->dev->planes_cap; i++)
+     {
+        if (layer->relax_planes[i] == plane->id)
+          return true;
+     }
+
+   return false;
+}
+
+void
+layer_relax_plane_add(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane)
+{
+   size_t i = 0;
+
+   if (layer_relax_plane_get(layer, plane)) return;
+
+   for (; i < layer->output->dev->planes_cap; i++)
+     {
+        if (layer->relax_planes[i] == 0)
+          {
+             layer->relax_planes[i] = plane->id;
+             return;
+          }
+     }
+}
+
+void
+layer_relax_plane_remove(struct liftoff_rpi_layer *layer, struct liftoff_rpi_plane *plane)
+{
+   size_t i = 0;
 
-   fb_id_prop = layer_property_get(layer, LIFTOFF_RPI_PROP_FB_ID);
-   if (!fb_id_prop || fb_id_prop->value == 0)
+   for (; i < layer->output->dev->planes_cap; i++)
      {
-        memset(&layer->fb_info, 0, sizeof(layer->fb_info));
-        return 0;
+        if (layer->relax_planes[i] == plane->id)
+          layer->relax_planes[i] = 0;
      }
+}
+
+void
+layer_relax_planes_reset(struct liftoff_rpi_layer *layer)
+{
+   memset(layer->relax_planes, 0,
+          sizeof(layer->relax_planes[0]) * layer->output->dev->planes_cap);
+}
+
+/* Layer splitting
+ *
+ * A layer wider than the output's split width is scanned out as up to
+ * LIFTOFF_RPI_SPLIT_MAX strips side by side, each a layer of its own that
+ * the compositor never sees. The strips form a group so either they all
+ * get a plane or the layer is composited, and the layer itself is left
+ * out of the search. */
 
-   if (layer->fb_info.fb_id == fb_id_prop->value)
+static size_t
+layer_split_count_get(struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_output *output;
+   struct liftoff_rpi_property *prop;
+   uint64_t width;
+   size_t n;
+
+   output = layer->output;
+   if (!output->split_width) return 0;
+   if (layer == output->comp_layer || layer->group || layer->force_comp)
      return 0;
+   if (!layer_fb_get(layer)) return 0;
+
+   prop = layer_property_get(layer, LIFTOFF_RPI_PROP_ROTATION);
+   if (prop && prop->value != DRM_MODE_ROTATE_0) return 0;
+
+   prop = layer_property_get(layer, LIFTOFF_RPI_PROP_CRTC_W);
+   if (!prop || prop->value == 0) return 0;
 
-   fb_info = drmModeGetFB2(layer->output->dev->fd, fb_id_prop->value);
-   if (!fb_info)
+   prop = layer_property_get(layer, LIFTOFF_RPI_PROP_SRC_W);
+   if (!prop) return 0;
+
+   width = prop->value >> 16;
+   if (width <= output->split_width) return 0;
+
+   n = (size_t)((width + output->split_width - 1) / output->split_width);
+   if (n > LIFTOFF_RPI_SPLIT_MAX) return 0;
+
+   return n;
+}
+
+static void
+layer_split_remove(struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_layer_group *split;
+   struct liftoff_rpi_layer *strip;
+   size_t i = 0;
+
+   split = layer->split;
+   if (!split) return;
+
+   /* destroying the strips here could pull them from under a caller
+    * walking the layer list */
+   for (; i < split->layers_len; i++)
      {
-        if (errno == EINVAL)
-          return 0;
-        return -errno;
+        strip = split->layers[i];
+        strip->split_parent = NULL;
+        strip->split_orphan = true;
+        liftoff_rpi_layer_property_unset(strip, LIFTOFF_RPI_PROP_FB_ID);
      }
 
-   /* drmModeGetFB2() always creates new GEM handles -- close these, we
-    * won't use them and we don't want to leak them */
-   num_planes = sizeof(fb_info->handles) / sizeof(fb_info->handles[0]);
-   for (i = 0; i < num_planes; i++)
+   layer->split = NULL;
+   liftoff_rpi_layer_group_destroy(split);
+}
+
+static int
+layer_split_add(struct liftoff_rpi_layer *layer, size_t n)
+{
+   struct liftoff_rpi_layer *strip;
+   size_t i = 0;
+   int ret;
+
+   layer->split = liftoff_rpi_layer_group_create(layer->output);
+   if (!layer->split) return -ENOMEM;
+
+   for (; i < n; i++)
      {
-        if (fb_info->handles[i] == 0)
-          continue;
+        strip = liftoff_rpi_layer_create(layer->output);
+        if (!strip)
+          {
+             layer_split_remove(layer);
+             return -ENOMEM;
+          }
 
-        ret = drmCloseBufferHandle(layer->output->dev->fd,
-                                   fb_info->handles[i]);
+        strip->split_parent = layer;
+        ret = liftoff_rpi_layer_group_layer_add(layer->split, strip);
         if (ret != 0)
           {
-             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmCloseBufferHandle");
-             continue;
+             strip->split_orphan = true;
+             layer_split_remove(layer);
+             return ret;
           }
+     }
+
+   return 0;
+}
+
+static uint64_t
+layer_prop_value_get(struct liftoff_rpi_layer *layer, int property)
+{
+   struct liftoff_rpi_property *prop;
+
+   prop = layer_property_get(layer, property);
+   return (prop != NULL ? prop->value : 0);
+}
+
+/* copies the layer's props over strip i of n, cutting the CRTC rectangle
+ * at whole pixels and the source at the matching offsets */
+static int
+layer_split_sync(struct liftoff_rpi_layer *layer, struct liftoff_rpi_layer *strip, size_t i, size_t n)
+{
+   struct liftoff_rpi_property *prop;
+   uint64_t crtc_w, src_w, x0, x1, sx0, sx1, value;
+   int64_t crtc_x;
+   size_t j;
+   int ret;
+
+   /* strips always have their own CRTC_X and SRC_X */
+   j = strip->props_len;
+   while (j-- > 0)
+     {
+        if (strip->props[j].index == LIFTOFF_RPI_PROP_CRTC_X ||
+            strip->props[j].index == LIFTOFF_RPI_PROP_SRC_X)
+          continue;
+        if (!layer_property_get(layer, strip->props[j].index))
+          liftoff_rpi_layer_property_unset(strip, strip->props[j].index);
+     }
+
+   crtc_x = (int64_t)layer_prop_value_get(layer, LIFTOFF_RPI_PROP_CRTC_X);
+   crtc_w = layer_prop_value_get(layer, LIFTOFF_RPI_PROP_CRTC_W);
+   src_w = layer_prop_value_get(layer, LIFTOFF_RPI_PROP_SRC_W);
 
-        /* Make sure we don't double-close a handle */
-        for (j = i + 1; j < num_planes; j++)
+   x0 = crtc_w * i / n;
+   x1 = crtc_w * (i + 1) / n;
+   sx0 = src_w * x0 / crtc_w;
+   sx1 = src_w * x1 / crtc_w;
+
+   for (j = 0; j < layer->props_len; j++)
+     {
+        prop = &layer->props[j];
+        switch (prop->index)
           {
-             if (fb_info->handles[j] == fb_info->handles[i])
-               fb_info->handles[j] = 0;
+           case LIFTOFF_RPI_PROP_CRTC_X:
+             value = (uint64_t)(crtc_x + (int64_t)x0);
+             break;
+           case LIFTOFF_RPI_PROP_CRTC_W:
+             value = x1 - x0;
+             break;
+           case LIFTOFF_RPI_PROP_SRC_X:
+             value = prop->value + sx0;
+             break;
+           case LIFTOFF_RPI_PROP_SRC_W:
+             value = sx1 - sx0;
+             break;
+           default:
+             value = prop->value;
+             break;
           }
-        fb_info->handles[i] = 0;
+
+        ret = liftoff_rpi_layer_property_set(strip, prop->index, value);
+        if (ret != 0) return ret;
      }
 
-   layer->fb_info = *fb_info;
-   drmModeFreeFB2(fb_info);
+   /* without a CRTC_X or SRC_X the layer starts at 0 */
+   if (!layer_property_get(layer, LIFTOFF_RPI_PROP_CRTC_X))
+     {
+        ret = liftoff_rpi_layer_property_set(strip, LIFTOFF_RPI_PROP_CRTC_X,
+                                             x0);
+        if (ret != 0) return ret;
+     }
+   if (!layer_property_get(layer, LIFTOFF_RPI_PROP_SRC_X))
+     return liftoff_rpi_layer_property_set(strip, LIFTOFF_RPI_PROP_SRC_X, sx0);
+
    return 0;
 }
 
+void
+layers_split_update(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_layer *layer, *tmp;
+   size_t i, n;
+
+   liftoff_rpi_list_for_each_safe(layer, tmp, &output->layers, link)
+     {
+        if (layer->split_orphan)
+          {
+             liftoff_rpi_layer_destroy(layer);
+             continue;
+          }
+        if (layer->split_parent) continue;
+
+        n = layer_split_count_get(layer);
+        if (layer->split && layer->split->layers_len != n)
+          {
+             layer_split_remove(layer);
+             output->layers_changed = true;
+          }
+        if (!n) continue;
+
+        if (!layer->split)
+          {
+             if (layer_split_add(layer, n) != 0) continue;
+             liftoff_rpi_log(LIFTOFF_RPI_DEBUG, "Layer %p split in %zu",
+                             (void *)layer, n);
+          }
+
+        for (i = 0; i < n; i++)
+          {
+             if (layer_split_sync(layer, layer->split->layers[i], i, n) != 0)
+               {
+                  layer_split_remove(layer);
+                  break;
+               }
+          }
+     }
+}
+
+static void
+layer_props_release(struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_output *output;
+
+   output = layer->output;
+   if (layer->props && output->props_spare_len < LIFTOFF_RPI_PROPS_SPARE)
+     {
+        output->props_spare[output->props_spare_len] = layer->props;
+        output->props_spare_cap[output->props_spare_len] = layer->props_cap;
+        output->props_spare_len++;
+     }
+   else
+     free(layer->props);
+
+   layer->props = NULL;
+   layer->props_len = 0;
+   layer->props_cap = 0;
+}
+
 /* API functions */
 struct liftoff_rpi_layer *
 liftoff_rpi_layer_create(struct liftoff_rpi_output *output)
 {
    struct liftoff_rpi_layer *layer;
 
-   layer = calloc(1, sizeof(*layer));
+   layer = liftoff_rpi_slab_alloc(&output->layers_slab);
    if (!layer)
      {
-        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "malloc");
         return NULL;
      }
 
    layer->output = output;
+   layer->fb_change_time = timing_now_get();
+   layer->candidate_planes = (uint32_t *)(layer + 1);
+   layer->relax_planes = layer->candidate_planes + output->dev->planes_cap;
 
-   layer->candidate_planes = calloc(sizeof(layer->candidate_planes[0]),
-                                    output->dev->planes_cap);
-   if (!layer->candidate_planes)
+   /* popups and tooltips come and go, keep their props storage */
+   if (output->props_spare_len > 0)
      {
-        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
-        free(layer);
-        return NULL;
+        output->props_spare_len--;
+        layer->props = output->props_spare[output->props_spare_len];
+        layer->props_cap = output->props_spare_cap[output->props_spare_len];
      }
 
    liftoff_rpi_list_insert(output->layers.prev, &layer->link);
@@ -245,22 +498,51 @@ liftoff_rpi_layer_create(struct liftoff_rpi_output *output)
 void
 liftoff_rpi_layer_destroy(struct liftoff_rpi_layer *layer)
 {
+   struct liftoff_rpi_output *output;
+
    if (!layer) return;
 
+   layer_split_remove(layer);
+   damage_layer_fini(layer);
+   fb_layer_fini(layer);
+
    layer->output->layers_changed = true;
+   if (layer->composited)
+     layer->output->comp_dirty = true;
+   if (layer->group)
+     liftoff_rpi_layer_group_layer_remove(layer->group, layer);
    if (layer->plane)
      layer->plane->layer = NULL;
    if (layer->output->comp_layer == layer)
      layer->output->comp_layer = NULL;
-   free(layer->props);
-   free(layer->candidate_planes);
+   layer_props_release(layer);
    liftoff_rpi_list_remove(&layer->link);
-   free(layer);
+
+   output = layer->output;
+   liftoff_rpi_slab_free(&output->layers_slab, layer);
+   if (output->destroyed && liftoff_rpi_list_empty(&output->layers))
+     output_free(output);
 }
 
 bool
 liftoff_rpi_layer_needs_composition(struct liftoff_rpi_layer *layer)
 {
+   struct liftoff_rpi_layer *strip;
+   size_t i = 0;
+
+   if (layer->split_parent || layer->split_orphan) return false;
+
+   if (layer->split)
+     {
+        for (; i < layer->split->layers_len; i++)
+          {
+             strip = layer->split->layers[i];
+             if (layer_visible_get(strip) && !strip->plane)
+               return true;
+          }
+        return false;
+     }
+
    if (!layer_visible_get(layer)) return false;
    return (layer->plane == NULL);
 }
@@ -269,6 +551,7 @@ int
 liftoff_rpi_layer_property_set(struct liftoff_rpi_layer *layer, int property, uint64_t value)
 {
    struct liftoff_rpi_property *prop, *props;
+   uint32_t cap;
 
    if (property == LIFTOFF_RPI_PROP_CRTC_ID)
      {
@@ -279,15 +562,21 @@ liftoff_rpi_layer_property_set(struct liftoff_rpi_layer *layer, int property, ui
    prop = layer_property_get(layer, property);
    if (!prop)
      {
-        props = realloc(layer->props, (layer->props_len + 1) *
-                        sizeof(struct liftoff_rpi_property));
-        if (!props)
+        if (layer->props_len == layer->props_cap)
           {
-             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "realloc");
-             return -ENOMEM;
+             cap = (layer->props_cap ? layer->props_cap * 2 : 8);
+             props = realloc(layer->props,
+                             cap * sizeof(struct liftoff_rpi_property));
+             if (!props)
+               {
+                  liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "realloc");
+                  return -ENOMEM;
+               }
+
+             layer->props = props;
+             layer->props_cap = cap;
           }
 
-        layer->props = props;
         layer->props_len++;
 
         prop = &layer->props[layer->props_len - 1];
@@ -297,6 +586,17 @@ liftoff_rpi_layer_property_set(struct liftoff_rpi_layer *layer, int property, ui
         layer->changed = true;
      }
 
+   /* the caller took over from liftoff_rpi_layer_damage_set */
+   if (property == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS &&
+       layer->damage_blob && value != layer->damage_blob)
+     damage_layer_forget(layer);
+
+   /* the kernel may take the new value */
+   if (prop->value != value &&
+       (property == LIFTOFF_RPI_PROP_SCALING_FILTER ||
+        property == LIFTOFF_RPI_PROP_PIXEL_BLEND_MODE))
+     layer_relax_planes_reset(layer);
+
    prop->value = value;
 
    if (property == LIFTOFF_RPI_PROP_FB_ID && layer->force_comp)
@@ -316,6 +616,9 @@ liftoff_rpi_layer_property_unset(struct liftoff_rpi_layer *layer, int property)
    prop = layer_property_get(layer, property);
    if (!prop) return;
 
+   if (property == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS)
+     damage_layer_forget(layer);
+
    last = &layer->props[layer->props_len - 1];
    if (prop != last)
      *prop = *last;
@@ -340,6 +643,8 @@ liftoff_rpi_layer_fb_composited_set(struct liftoff_rpi_layer *layer)
 struct liftoff_rpi_plane *
 liftoff_rpi_layer_plane_get(struct liftoff_rpi_layer *layer)
 {
+   /* the plane of the leftmost strip */
+   if (layer->split) return layer->split->layers[0]->plane;
    return layer->plane;
 }
 
@@ -360,5 +665,13 @@ liftoff_rpi_layer_candidate_plane_get(struct liftoff_rpi_layer *layer, struct li
 bool
 liftoff_rpi_layer_visible_get(struct liftoff_rpi_layer *layer)
 {
+   if (layer->split) return layer_visible_get(layer->split->layers[0]);
    return layer_visible_get(layer);
 }
+
+bool
+liftoff_rpi_layer_property_relaxed_get(struct liftoff_rpi_layer *layer, int property)
+{
+   if (!layer->plane || property < 0 || property >= 32) return false;
+   return (plane_relaxed_get(layer->plane, layer) & (1u << property)) != 0;
+}
@@ -0,0 +1,144 @@
+#include "private.h"
+
+/* Allocations of recently seen scenes. A scene is keyed by a hash of what
+ * the search looks at: the layers' properties (but not which FB they show),
+ * their FB formats and sizes, and which planes other outputs hold or keep. Entries
+ * map each plane to the index of its layer in the output's layer list, or
+ * to -1. A hit is only a guess and gets verified with a test commit. */
+
+static uint64_t
+memo_hash(uint64_t hash, uint64_t value)
+{
+   size_t i = 0;
+
+   /* FNV-1a */
+   for (; i < sizeof(value); i++)
+     {
+        hash ^= (value >> (i * 8)) & 0xFF;
+        hash *= 0x100000001b3;
+     }
+
+   return hash;
+}
+
+/* local functions */
+uint64_t
+memo_signature_get(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   struct liftoff_rpi_property *prop;
+   uint64_t hash = 0xcbf29ce484222325;
+   size_t i;
+
+   hash = memo_hash(hash, output->idle);
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        hash = memo_hash(hash, plane->layer != NULL);
+        hash = memo_hash(hash, plane->reserved && plane->reserved != output);
+     }
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        hash = memo_hash(hash, layer_visible_get(layer));
+        hash = memo_hash(hash, layer == output->comp_layer);
+        hash = memo_hash(hash, layer->force_comp);
+        hash = memo_hash(hash, layer->group ? layer->group->serial : 0);
+        if (layer->fb)
+          {
+             hash = memo_hash(hash, layer->fb->pixel_format);
+             hash = memo_hash(hash, layer->fb->modifier);
+             hash = memo_hash(hash, layer->fb->width);
+             hash = memo_hash(hash, layer->fb->height);
+          }
+        else
+          hash = memo_hash(hash, 0);
+
+        for (i = 0; i < layer->props_len; i++)
+          {
+             prop = &layer->props[i];
+             if (prop->index == LIFTOFF_RPI_PROP_FB_ID ||
+                 prop->index == LIFTOFF_RPI_PROP_IN_FENCE_FD ||
+                 prop->index == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS)
+               continue;
+
+             hash = memo_hash(hash, (uint64_t)prop->index);
+             hash = memo_hash(hash, prop->value);
+          }
+
+        hash = memo_hash(hash, UINT64_MAX);
+     }
+
+   return hash;
+}
+
+const int16_t *
+memo_lookup(struct liftoff_rpi_output *output, uint64_t signature, size_t planes_len)
+{
+   struct liftoff_rpi_memo_entry *entry;
+   size_t i = 0;
+
+   for (; i < LIFTOFF_RPI_MEMO_LEN; i++)
+     {
+        entry = &output->memo[i];
+        if (entry->planes && entry->signature == signature &&
+            entry->planes_len == planes_len)
+          return entry->planes;
+     }
+
+   return NULL;
+}
+
+void
+memo_store(struct liftoff_rpi_output *output, uint64_t signature, const int16_t *planes, size_t planes_len)
+{
+   struct liftoff_rpi_memo_entry *entry;
+   int16_t *copy;
+
+   if (memo_lookup(output, signature, planes_len)) return;
+
+   entry = &output->memo[output->memo_next];
+
+   if (entry->planes_len != planes_len)
+     {
+        copy = realloc(entry->planes, planes_len * sizeof(*copy));
+        if (!copy)
+          {
+             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "realloc");
+             return;
+          }
+        entry->planes = copy;
+        entry->planes_len = planes_len;
+     }
+
+   memcpy(entry->planes, planes, planes_len * sizeof(*planes));
+   entry->signature = signature;
+
+   output->memo_next = (output->memo_next + 1) % LIFTOFF_RPI_MEMO_LEN;
+}
+
+void
+memo_forget(struct liftoff_rpi_output *output, uint64_t signature)
+{
+   size_t i = 0;
+
+   for (; i < LIFTOFF_RPI_MEMO_LEN; i++)
+     {
+        if (output->memo[i].signature == signature)
+          output->memo[i].signature = 0;
+     }
+}
+
+void
+memo_fini(struct liftoff_rpi_output *output)
+{
+   size_t i = 0;
+
+   for (; i < LIFTOFF_RPI_MEMO_LEN; i++)
+     {
+        free(output->memo[i].planes);
+        output->memo[i].planes = NULL;
+        output->memo[i].planes_len = 0;
+     }
+}
@@ -89,6 +89,276 @@ output_log_layers(struct liftoff_rpi_output *output)
    }
 }
 
+static bool
+layer_composition_changed_get(struct liftoff_rpi_layer *layer)
+{
+   size_t i = 0;
+   struct liftoff_rpi_property *prop;
+
+   if (layer->changed) return true;
+
+   for (; i < layer->props_len; i++)
+     {
+        prop = &layer->props[i];
+
+        if (prop->index == LIFTOFF_RPI_PROP_IN_FENCE_FD)
+          continue;
+
+        /* the composition layer is the buffer itself: only its geometry
+         * matters */
+        if (layer == layer->output->comp_layer)
+          {
+             if (prop->index == LIFTOFF_RPI_PROP_FB_ID ||
+                 prop->index == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS)
+               continue;
+          }
+        else if (prop->index == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS)
+          {
+             /* damage on an unchanged FB means it was drawn into */
+             if (prop->value != 0) return true;
+             continue;
+          }
+
+        if (prop->value != prop->prev_value) return true;
+     }
+
+   return false;
+}
+
+static void
+rect_union(struct liftoff_rpi_rect *ra, const struct liftoff_rpi_rect *rb)
+{
+   int x2, y2;
+
+   if (rb->w <= 0 || rb->h <= 0) return;
+   if (ra->w <= 0 || ra->h <= 0)
+     {
+        *ra = *rb;
+        return;
+     }
+
+   x2 = (ra->x + ra->w > rb->x + rb->w) ? ra->x + ra->w : rb->x + rb->w;
+   y2 = (ra->y + ra->h > rb->y + rb->h) ? ra->y + ra->h : rb->y + rb->h;
+   if (rb->x < ra->x) ra->x = rb->x;
+   if (rb->y < ra->y) ra->y = rb->y;
+   ra->w = x2 - ra->x;
+   ra->h = y2 - ra->y;
+}
+
+static void
+rect_clip(struct liftoff_rpi_rect *ra, const struct liftoff_rpi_rect *rb)
+{
+   int x2, y2;
+
+   x2 = (ra->x + ra->w < rb->x + rb->w) ? ra->x + ra->w : rb->x + rb->w;
+   y2 = (ra->y + ra->h < rb->y + rb->h) ? ra->y + ra->h : rb->y + rb->h;
+   if (rb->x > ra->x) ra->x = rb->x;
+   if (rb->y > ra->y) ra->y = rb->y;
+   ra->w = x2 - ra->x;
+   ra->h = y2 - ra->y;
+}
+
+/* Bounds of what the composition layer has to show: the composited layers,
+ * plus layers on planes under it that it used to hide, within the
+ * composition layer, which stands for the CRTC. Grown to the minimum FB
+ * size the device takes, and left empty, so the whole layer gets
+ * rendered, when above the maximum. */
+static void
+output_composition_rect_update(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_layer *layer;
+   struct liftoff_rpi_property *zprop, *comp_zprop = NULL;
+   struct liftoff_rpi_rect *rect, lrect, crtc;
+   bool needed = false;
+
+   dev = output->dev;
+   rect = &output->comp_rect;
+   memset(rect, 0, sizeof(*rect));
+
+   if (!output->comp_layer) return;
+   comp_zprop = layer_property_get(output->comp_layer, LIFTOFF_RPI_PROP_ZPOS);
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        /* split layers are hidden from the search but still shown */
+        if (layer == output->comp_layer ||
+            (!layer->split && !layer_visible_get(layer)))
+          continue;
+
+        if (!layer->composited)
+          {
+             zprop = layer_property_get(layer, LIFTOFF_RPI_PROP_ZPOS);
+             if (!comp_zprop || !zprop ||
+                 (int)zprop->value >= (int)comp_zprop->value ||
+                 !layer_intersects(layer, output->comp_layer))
+               continue;
+          }
+        else
+          needed = true;
+
+        layer_rect_get(layer, &lrect, false);
+        rect_union(rect, &lrect);
+     }
+
+   layer_rect_get(output->comp_layer, &crtc, false);
+   rect_clip(rect, &crtc);
+
+   if (!needed || rect->w <= 0 || rect->h <= 0 ||
+       (dev->max_width && rect->w > (int)dev->max_width) ||
+       (dev->max_height && rect->h > (int)dev->max_height))
+     {
+        memset(rect, 0, sizeof(*rect));
+        return;
+     }
+
+   /* grow towards the top left once at the right or bottom edge */
+   if (rect->w < (int)dev->min_width)
+     {
+        rect->w = (int)dev->min_width;
+        if (rect->x + rect->w > crtc.x + crtc.w)
+          rect->x = crtc.x + crtc.w - rect->w;
+        if (rect->x < crtc.x) rect->x = crtc.x;
+     }
+   if (rect->h < (int)dev->min_height)
+     {
+        rect->h = (int)dev->min_height;
+        if (rect->y + rect->h > crtc.y + crtc.h)
+          rect->y = crtc.y + crtc.h - rect->h;
+        if (rect->y < crtc.y) rect->y = crtc.y;
+     }
+}
+
+void
+output_composition_update(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_layer *layer;
+   bool composited, changed, needed = false;
+
+   changed = output->comp_dirty;
+
+   if (output->comp_layer &&
+       layer_composition_changed_get(output->comp_layer))
+     changed = true;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer == output->comp_layer || layer->split_parent) continue;
+
+        composited = liftoff_rpi_layer_needs_composition(layer);
+        if (composited != layer->composited)
+          changed = true;
+        else if (composited)
+          {
+             /* we have no idea what the compositor draws for layers
+              * without a FB */
+             if (layer->force_comp ||
+                 layer_composition_changed_get(layer))
+               changed = true;
+          }
+
+        layer->composited = composited;
+        if (composited) needed = true;
+     }
+
+   output->comp_dirty = false;
+   output->comp_unchanged = (needed && !changed);
+
+   output_composition_rect_update(output);
+}
+
+static unsigned int
+plane_crtcs_count(struct liftoff_rpi_plane *plane)
+{
+   uint32_t crtcs = plane->possible_crtcs;
+   unsigned int n = 0;
+
+   for (; crtcs; crtcs &= crtcs - 1)
+     n++;
+
+   return n;
+}
+
+/* picks the overlay plane to keep for output next: one it already uses,
+ * else the free one fewest other CRTCs can use, else one another output
+ * uses without having it reserved */
+static struct liftoff_rpi_plane *
+output_plane_reserve_pick(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_plane *plane, *best = NULL;
+   unsigned int rank, best_rank = 0;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (plane->type != DRM_PLANE_TYPE_OVERLAY || plane->reserved)
+          continue;
+        if ((plane->possible_crtcs & (1 << output->crtc_index)) == 0)
+          continue;
+
+        if (plane->layer && plane->layer->output == output)
+          rank = 1;
+        else if (!plane->layer)
+          rank = 1 + plane_crtcs_count(plane);
+        else
+          rank = 64;
+
+        if (!best || rank < best_rank)
+          {
+             best = plane;
+             best_rank = rank;
+          }
+     }
+
+   return best;
+}
+
+void
+output_planes_reserve(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_plane *plane;
+   unsigned int reserved = 0;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (plane->reserved != output) continue;
+        if (reserved < output->plane_min)
+          reserved++;
+        else
+          plane->reserved = NULL;
+     }
+
+   for (; reserved < output->plane_min; reserved++)
+     {
+        plane = output_plane_reserve_pick(output);
+        if (!plane)
+          {
+             liftoff_rpi_log(LIFTOFF_RPI_DEBUG,
+                             "Output %p: only %u of %u planes could be "
+                             "reserved", (void *)output, reserved,
+                             output->plane_min);
+             break;
+          }
+
+        plane->reserved = output;
+
+        /* the holder has to move off it on its next apply */
+        if (plane->layer && plane->layer->output != output)
+          plane->layer->output->layers_changed = true;
+     }
+}
+
+void
+output_free(struct liftoff_rpi_output *output)
+{
+   damage_output_fini(output);
+
+   while (output->props_spare_len > 0)
+     free(output->props_spare[--output->props_spare_len]);
+
+   liftoff_rpi_slab_fini(&output->layers_slab);
+   liftoff_rpi_slab_free(&output->dev->outputs_slab, output);
+}
+
 struct liftoff_rpi_output *
 liftoff_rpi_output_create(struct liftoff_rpi_device *dev, uint32_t crtc_id)
 {
@@ -107,18 +377,30 @@ liftoff_rpi_output_create(struct liftoff_rpi_device *dev, uint32_t crtc_id)
 
    if (crtc_index < 0) return NULL;
 
-   output = calloc(1, sizeof(*output));
+   output = liftoff_rpi_slab_alloc(&dev->outputs_slab);
    if (!output)
      {
-        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "malloc");
         return NULL;
      }
 
    output->dev = dev;
    output->crtc_id = crtc_id;
    output->crtc_index = (size_t)crtc_index;
+   output->comp_dirty = true;
+   output->stats.crtc_id = crtc_id;
+   output->strategy = LIFTOFF_RPI_STRATEGY_EXHAUSTIVE;
+   output->search_budget = 2000000;
+   output->deadline_budget = -1;
+   output->stagger_deadline = -1;
+   output->plane_max = -1;
 
    liftoff_rpi_list_init(&output->layers);
+   liftoff_rpi_list_init(&output->groups);
+
+   liftoff_rpi_slab_init(&output->layers_slab,
+                         sizeof(struct liftoff_rpi_layer) +
+                         2 * dev->planes_cap * sizeof(uint32_t), 16);
    liftoff_rpi_list_insert(&dev->outputs, &output->link);
 
    return output;
@@ -127,9 +409,51 @@ liftoff_rpi_output_create(struct liftoff_rpi_device *dev, uint32_t crtc_id)
 void
 liftoff_rpi_output_destroy(struct liftoff_rpi_output *output)
 {
+   struct liftoff_rpi_plane *plane;
+   struct liftoff_rpi_layer *layer;
+   struct liftoff_rpi_layer_group *group, *gtmp;
+
    if (!output) return;
+
+   /* leave an empty slot behind for readers */
+   memset(&output->stats, 0, sizeof(output->stats));
+   stats_output_publish(output);
+
+   liftoff_rpi_output_search_dump_set(output, NULL, 0);
+   memo_fini(output);
+
+   /* strips are ours to free, and may still hold planes */
+   output->split_width = 0;
+   layers_split_update(output);
+
+   liftoff_rpi_list_for_each_safe(group, gtmp, &output->groups, link)
+     liftoff_rpi_layer_group_destroy(group);
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        damage_layer_fini(layer);
+        fb_layer_fini(layer);
+        if (layer->plane) layer->plane->layer = NULL;
+        layer->plane = NULL;
+     }
+   damage_output_fini(output);
+   output->comp_layer = NULL;
+
+   if (output->dev->stagger_owner == output)
+     output->dev->stagger_owner = NULL;
+
+   liftoff_rpi_list_for_each(plane, &output->dev->planes, link)
+     {
+        if (plane->reserved == output) plane->reserved = NULL;
+     }
+
    liftoff_rpi_list_remove(&output->link);
-   free(output);
+
+   /* layers the caller still holds live in our slab, the last one to go
+    * frees it */
+   output->destroyed = true;
+   if (liftoff_rpi_list_empty(&output->layers))
+     output_free(output);
 }
 
 void
@@ -137,7 +461,11 @@ liftoff_rpi_output_composition_layer_set(struct liftoff_rpi_output *output, stru
 {
    if (layer->output != output) return;
 
-   if (layer != output->comp_layer) output->layers_changed = true;
+   if (layer != output->comp_layer)
+     {
+        output->layers_changed = true;
+        output->comp_dirty = true;
+     }
    output->comp_layer = layer;
 }
 
@@ -154,3 +482,100 @@ liftoff_rpi_output_needs_composition(struct liftoff_rpi_output *output)
 
    return false;
 }
+
+bool
+liftoff_rpi_output_composition_unchanged_get(struct liftoff_rpi_output *output)
+{
+   return output->comp_unchanged;
+}
+
+void
+liftoff_rpi_output_idle_consolidation_set(struct liftoff_rpi_output *output, unsigned int secs)
+{
+   output->idle_timeout = (int64_t)secs * 1000000000;
+}
+
+int
+liftoff_rpi_output_strategy_set(struct liftoff_rpi_output *output, enum liftoff_rpi_strategy strategy)
+{
+   switch (strategy)
+     {
+      case LIFTOFF_RPI_STRATEGY_EXHAUSTIVE:
+      case LIFTOFF_RPI_STRATEGY_BOUNDED:
+      case LIFTOFF_RPI_STRATEGY_GREEDY:
+      case LIFTOFF_RPI_STRATEGY_MEMOIZED:
+      case LIFTOFF_RPI_STRATEGY_AUTO:
+      case LIFTOFF_RPI_STRATEGY_ZPOS_DP:
+        break;
+      default:
+        return -EINVAL;
+     }
+
+   output->strategy = strategy;
+   return 0;
+}
+
+void
+liftoff_rpi_output_search_budget_set(struct liftoff_rpi_output *output, unsigned int usecs)
+{
+   output->search_budget = (int64_t)usecs * 1000;
+}
+
+int
+liftoff_rpi_output_plane_quota_set(struct liftoff_rpi_output *output, unsigned int min, int max)
+{
+   if (max >= 0 && min > (unsigned int)max) return -EINVAL;
+
+   output->plane_min = min;
+   output->plane_max = max;
+   output->layers_changed = true;
+   memo_fini(output);
+
+   output_planes_reserve(output);
+   return 0;
+}
+
+void
+liftoff_rpi_output_relaxation_set(struct liftoff_rpi_output *output, bool enable)
+{
+   struct liftoff_rpi_layer *layer;
+
+   if (output->relax == enable) return;
+
+   output->relax = enable;
+   output->layers_changed = true;
+   memo_fini(output);
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     layer_relax_planes_reset(layer);
+}
+
+void
+liftoff_rpi_output_zpos_mutable_set(struct liftoff_rpi_output *output, bool enable)
+{
+   output->zpos_mutable = enable;
+}
+
+bool
+liftoff_rpi_output_composition_rect_get(struct liftoff_rpi_output *output, int *x, int *y, int *w, int *h)
+{
+   const struct liftoff_rpi_rect *rect;
+
+   rect = &output->comp_rect;
+   if (rect->w <= 0 || rect->h <= 0) return false;
+
+   *x = rect->x;
+   *y = rect->y;
+   *w = rect->w;
+   *h = rect->h;
+   return true;
+}
+
+void
+liftoff_rpi_output_layer_split_set(struct liftoff_rpi_output *output, unsigned int max_width)
+{
+   if (output->split_width == max_width) return;
+
+   output->split_width = max_width;
+   output->layers_changed = true;
+}
@@ -1,3 +1,4 @@
+#include <drm_fourcc.h>
 #include "private.h"
 
 /* local functions */
@@ -72,6 +73,98 @@ plane_prop_bitmask_check(const drmModePropertyRes *prop, uint64_t value)
    return 0;
 }
 
+static int
+plane_prop_value_check(const drmModePropertyRes *prop, uint64_t value)
+{
+   switch (drmModeGetPropertyType(prop))
+     {
+      case DRM_MODE_PROP_RANGE:
+        return plane_prop_range_check(prop, value);
+      case DRM_MODE_PROP_ENUM:
+        return plane_prop_enum_check(prop, value);
+      case DRM_MODE_PROP_BITMASK:
+        return plane_prop_bitmask_check(prop, value);
+      case DRM_MODE_PROP_SIGNED_RANGE:
+        return plane_prop_signed_range_check(prop, value);
+     }
+
+   return 0;
+}
+
+static bool
+layer_fb_opaque_get(struct liftoff_rpi_layer *layer)
+{
+   if (!layer->fb) return false;
+
+   switch (layer->fb->pixel_format)
+     {
+      case 0:
+      case DRM_FORMAT_ARGB8888:
+      case DRM_FORMAT_ABGR8888:
+      case DRM_FORMAT_RGBA8888:
+      case DRM_FORMAT_BGRA8888:
+      case DRM_FORMAT_ARGB2101010:
+      case DRM_FORMAT_ABGR2101010:
+      case DRM_FORMAT_RGBA1010102:
+      case DRM_FORMAT_BGRA1010102:
+      case DRM_FORMAT_ARGB4444:
+      case DRM_FORMAT_ABGR4444:
+      case DRM_FORMAT_RGBA4444:
+      case DRM_FORMAT_BGRA4444:
+      case DRM_FORMAT_ARGB1555:
+      case DRM_FORMAT_ABGR1555:
+      case DRM_FORMAT_RGBA5551:
+      case DRM_FORMAT_BGRA5551:
+      case DRM_FORMAT_ARGB16161616F:
+      case DRM_FORMAT_ABGR16161616F:
+      case DRM_FORMAT_AYUV:
+        return false;
+      default:
+        return true;
+     }
+}
+
+/* Relaxation table: optional props whose value may be swapped for one the
+ * plane takes, without changing what ends up on screen. SCALING_FILTER
+ * falls back to the driver default and the blend mode of an FB without
+ * alpha doesn't matter. Props the plane lacks get left out. Values the
+ * plane advertises are only swapped once the kernel rejected them, see
+ * layer->relax_planes. Returns true if lprop is relaxed, with the value to
+ * use in value. */
+static bool
+plane_prop_relax(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, struct liftoff_rpi_property *lprop, struct liftoff_rpi_property *pprop, uint64_t *value)
+{
+   bool forced;
+
+   if (!layer->output->relax) return false;
+
+   forced = layer_relax_plane_get(layer, plane);
+   if (pprop && !forced &&
+       plane_prop_value_check(pprop->dprop, lprop->value) == 0)
+     return false;
+
+   switch (lprop->index)
+     {
+      case LIFTOFF_RPI_PROP_SCALING_FILTER:
+        *value = 0;
+        break;
+      case LIFTOFF_RPI_PROP_PIXEL_BLEND_MODE:
+        if (!layer_fb_opaque_get(layer)) return false;
+        if (pprop && pprop->dprop->count_enums > 0)
+          *value = pprop->dprop->enums[0].value;
+        else
+          *value = 0;
+        break;
+      default:
+        return false;
+     }
+
+   if (pprop && plane_prop_value_check(pprop->dprop, *value) != 0)
+     return false;
+
+   return (!pprop || *value != lprop->value);
+}
+
 static struct liftoff_rpi_property *
 plane_property_get(struct liftoff_rpi_plane *plane, int prop)
 {
@@ -120,22 +213,7 @@ plane_prop_set(struct liftoff_rpi_plane *plane, drmModeAtomicReq *req, int index
    if (prop->dprop->flags & DRM_MODE_PROP_IMMUTABLE)
      return -EINVAL;
 
-   switch (drmModeGetPropertyType(prop->dprop))
-     {
-      case DRM_MODE_PROP_RANGE:
-        ret = plane_prop_range_check(prop->dprop, value);
-        break;
-      case DRM_MODE_PROP_ENUM:
-        ret = plane_prop_enum_check(prop->dprop, value);
-        break;
-      case DRM_MODE_PROP_BITMASK:
-        ret = plane_prop_bitmask_check(prop->dprop, value);
-        break;
-      case DRM_MODE_PROP_SIGNED_RANGE:
-        ret = plane_prop_signed_range_check(prop->dprop, value);
-        break;
-     }
-
+   ret = plane_prop_value_check(prop->dprop, value);
    if (ret != 0) return ret;
 
    return plane_property_set(plane, req, prop->id, value);
@@ -147,6 +225,7 @@ plane_apply(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, dr
    int c, ret = 0;
    size_t i = 0;
    struct liftoff_rpi_property *lprop, *pprop;
+   uint64_t value;
 
    c = drmModeAtomicGetCursor(req);
    if (!layer)
@@ -167,8 +246,8 @@ plane_apply(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, dr
      {
         lprop = &layer->props[i];
 
-        /* we don't support setting the zpos property. Only used
-         * read-only during allocation */
+        /* only used during allocation, and written by alloc.c for the
+         * whole output in mutable zpos mode */
         if (lprop->index == LIFTOFF_RPI_PROP_ZPOS)
           continue;
 
@@ -189,12 +268,17 @@ plane_apply(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, dr
                continue;
              if (lprop->index == LIFTOFF_RPI_PROP_FB_DAMAGE_CLIPS)
                continue;
+             if (plane_prop_relax(plane, layer, lprop, NULL, &value))
+               continue;
 
              drmModeAtomicSetCursor(req, c);
              return -EINVAL;
           }
 
-        ret = plane_property_set(plane, req, pprop->id, lprop->value);
+        value = lprop->value;
+        plane_prop_relax(plane, layer, lprop, pprop, &value);
+
+        ret = plane_property_set(plane, req, pprop->id, value);
         if (ret != 0)
           {
              liftoff_rpi_log(LIFTOFF_RPI_ERROR,
@@ -208,6 +292,66 @@ plane_apply(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, dr
    return 0;
 }
 
+/* props of layer that plane_apply relaxes on plane, as a mask of
+ * (1 << index) */
+uint32_t
+plane_relaxed_get(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_property *lprop;
+   uint32_t mask = 0;
+   uint64_t value;
+   size_t i = 0;
+
+   for (; i < layer->props_len; i++)
+     {
+        lprop = &layer->props[i];
+        if (plane_prop_relax(plane, layer, lprop,
+                             plane_property_get(plane, lprop->index), &value))
+          mask |= 1u << lprop->index;
+     }
+
+   return mask;
+}
+
+bool
+plane_zpos_mutable_get(struct liftoff_rpi_plane *plane)
+{
+   struct liftoff_rpi_property *prop;
+
+   prop = plane_property_get(plane, LIFTOFF_RPI_PROP_ZPOS);
+   if (!prop) return false;
+
+   return (drmModeGetPropertyType(prop->dprop) == DRM_MODE_PROP_RANGE &&
+           !(prop->dprop->flags & DRM_MODE_PROP_IMMUTABLE));
+}
+
+/* range a mutable zpos may take */
+void
+plane_zpos_range_get(struct liftoff_rpi_plane *plane, uint64_t *min, uint64_t *max)
+{
+   struct liftoff_rpi_property *prop;
+
+   prop = plane_property_get(plane, LIFTOFF_RPI_PROP_ZPOS);
+   *min = prop->dprop->values[0];
+   *max = prop->dprop->values[1];
+}
+
+int
+plane_zpos_set(struct liftoff_rpi_plane *plane, drmModeAtomicReq *req, uint64_t value)
+{
+   return plane_prop_set(plane, req, LIFTOFF_RPI_PROP_ZPOS, value);
+}
+
+/* free, wired to the output's CRTC and not kept for another output */
+bool
+plane_usable_get(struct liftoff_rpi_plane *plane, struct liftoff_rpi_output *output)
+{
+   if (plane->layer != NULL) return false;
+   if ((plane->possible_crtcs & (1 << output->crtc_index)) == 0)
+     return false;
+   return (!plane->reserved || plane->reserved == output);
+}
+
 bool
 plane_check_layer_fb(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer)
 {
@@ -219,8 +363,8 @@ plane_check_layer_fb(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *
    int format_shift;
 
    /* TODO: add support for legacy format list with implicit modifier */
-   if (layer->fb_info.fb_id == 0 ||
-       !(layer->fb_info.flags & DRM_MODE_FB_MODIFIERS) ||
+   if (!layer->fb ||
+       !(layer->fb->flags & DRM_MODE_FB_MODIFIERS) ||
        plane->in_formats_blob == NULL)
      return true; /* not enough information to reject */
 
@@ -230,7 +374,7 @@ plane_check_layer_fb(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *
    format_index = -1;
    for (i = 0; i < set->count_formats; ++i)
      {
-      if (formats[i] == layer->fb_info.pixel_format)
+      if (formats[i] == layer->fb->pixel_format)
           {
              format_index = (ssize_t)i;
              break;
@@ -244,7 +388,7 @@ plane_check_layer_fb(struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *
    modifier_index = -1;
    for (i = 0; i < set->count_modifiers; i++)
      {
-        if (modifiers[i].modifier == layer->fb_info.modifier)
+        if (modifiers[i].modifier == layer->fb->modifier)
           {
              modifier_index = (ssize_t)i;
              break;
@@ -285,18 +429,20 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
           }
      }
 
-   plane = calloc(1, sizeof(*plane));
+   plane = liftoff_rpi_slab_alloc(&dev->planes_slab);
    if (!plane)
      {
-        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "malloc");
         return NULL;
      }
 
+   plane->dev = dev;
+
    dplane = drmModeGetPlane(dev->fd, id);
    if (!dplane)
      {
         liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmModeGetPlane");
-        free(plane);
+        liftoff_rpi_slab_free(&dev->planes_slab, plane);
         return NULL;
      }
 
@@ -308,7 +454,7 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
    if (!dprops)
      {
         liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmModeObjectGetProperties");
-        free(plane);
+        liftoff_rpi_slab_free(&dev->planes_slab, plane);
         return NULL;
      }
 
@@ -318,7 +464,7 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
      {
         liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "calloc");
         drmModeFreeObjectProperties(dprops);
-        free(plane);
+        liftoff_rpi_slab_free(&dev->planes_slab, plane);
         return NULL;
      }
 
@@ -332,7 +478,7 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
              liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmModeGetProperty");
              drmModeFreeObjectProperties(dprops);
              free(plane->props);
-             free(plane);
+             liftoff_rpi_slab_free(&dev->planes_slab, plane);
              return NULL;
           }
 
@@ -392,7 +538,7 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
                   drmModeFreeProperty(dprop);
                   drmModeFreeObjectProperties(dprops);
                   free(plane->props);
-                  free(plane);
+                  liftoff_rpi_slab_free(&dev->planes_slab, plane);
                   return NULL;
                }
           }
@@ -403,7 +549,7 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
              continue;
           }
 
-        prop = &plane->props[i];
+        prop = &plane->props[plane->props_len];
         prop->id = dprop->prop_id;
         prop->index = x;
         prop->dprop = dprop;
@@ -413,13 +559,21 @@ liftoff_rpi_plane_create(struct liftoff_rpi_device *dev, uint32_t id)
 
    drmModeFreeObjectProperties(dprops);
 
+   /* keep only the properties we know about, packed together */
+   if (plane->props_len > 0)
+     {
+        prop = realloc(plane->props,
+                       plane->props_len * sizeof(struct liftoff_rpi_property));
+        if (prop) plane->props = prop;
+     }
+
    if (!has_type)
      {
         liftoff_rpi_log(LIFTOFF_RPI_ERROR,
                         "plane %"PRIu32" is missing the 'type' property",
                         plane->id);
         free(plane->props);
-        free(plane);
+        liftoff_rpi_slab_free(&dev->planes_slab, plane);
         errno = EINVAL;
         return NULL;
      }
@@ -459,9 +613,9 @@ liftoff_rpi_plane_destroy(struct liftoff_rpi_plane *plane)
    for (; i < plane->props_len; i++)
      drmModeFreeProperty(plane->props[i].dprop);
 
-   free(plane->props);
+   if (!plane->props_packed) free(plane->props);
    drmModeFreePropertyBlob(plane->in_formats_blob);
-   free(plane);
+   liftoff_rpi_slab_free(&plane->dev->planes_slab, plane);
 }
 
 uint32_t
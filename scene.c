@@ -0,0 +1,133 @@
+#include "private.h"
+
+/* local functions */
+static struct liftoff_rpi_layer *
+scene_layer_find(struct liftoff_rpi_output *output, uint64_t key)
+{
+   struct liftoff_rpi_layer *layer;
+
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer->keyed && layer->key == key)
+          return layer;
+     }
+
+   return NULL;
+}
+
+static bool
+scene_desc_prop_has(const struct liftoff_rpi_layer_desc *desc, int property)
+{
+   size_t i = 0;
+
+   if (property == LIFTOFF_RPI_PROP_FB_ID && desc->fb_composited)
+     return true;
+
+   for (; i < desc->props_len; i++)
+     {
+        if (desc->props[i].property == property)
+          return true;
+     }
+
+   return false;
+}
+
+static int
+scene_layer_update(struct liftoff_rpi_layer *layer, const struct liftoff_rpi_layer_desc *desc)
+{
+   size_t i = layer->props_len;
+   int ret;
+
+   /* unset swaps the last property in, so walk backwards */
+   while (i-- > 0)
+     {
+        if (!scene_desc_prop_has(desc, layer->props[i].index))
+          liftoff_rpi_layer_property_unset(layer, layer->props[i].index);
+     }
+
+   for (i = 0; i < desc->props_len; i++)
+     {
+        if (desc->props[i].property == LIFTOFF_RPI_PROP_FB_ID &&
+            desc->fb_composited)
+          continue;
+
+        ret = liftoff_rpi_layer_property_set(layer, desc->props[i].property,
+                                             desc->props[i].value);
+        if (ret != 0) return ret;
+     }
+
+   if (desc->fb_composited)
+     liftoff_rpi_layer_fb_composited_set(layer);
+
+   if (desc->composition)
+     liftoff_rpi_output_composition_layer_set(layer->output, layer);
+
+   return 0;
+}
+
+/* API functions */
+int
+liftoff_rpi_output_scene_set(struct liftoff_rpi_output *output, const struct liftoff_rpi_layer_desc *descs, size_t descs_len)
+{
+   struct liftoff_rpi_layer *layer, *tmp;
+   size_t i = 0, j;
+   bool comp = false;
+   int ret;
+
+   for (; i < descs_len; i++)
+     {
+        for (j = i + 1; j < descs_len; j++)
+          {
+             if (descs[i].key == descs[j].key)
+               {
+                  liftoff_rpi_log(LIFTOFF_RPI_ERROR,
+                                  "duplicate scene key %"PRIu64,
+                                  descs[i].key);
+                  return -EINVAL;
+               }
+          }
+
+        if (descs[i].composition) comp = true;
+     }
+
+   output->scene_serial++;
+
+   for (i = 0; i < descs_len; i++)
+     {
+        layer = scene_layer_find(output, descs[i].key);
+        if (!layer)
+          {
+             layer = liftoff_rpi_layer_create(output);
+             if (!layer) return -ENOMEM;
+
+             layer->keyed = true;
+             layer->key = descs[i].key;
+          }
+
+        layer->scene_serial = output->scene_serial;
+
+        ret = scene_layer_update(layer, &descs[i]);
+        if (ret != 0) return ret;
+     }
+
+   if (!comp && output->comp_layer && output->comp_layer->keyed)
+     {
+        output->comp_layer = NULL;
+        output->layers_changed = true;
+        output->comp_dirty = true;
+     }
+
+   liftoff_rpi_list_for_each_safe(layer, tmp, &output->layers, link)
+     {
+        if (layer->keyed && layer->scene_serial != output->scene_serial)
+          liftoff_rpi_layer_destroy(layer);
+     }
+
+   return 0;
+}
+
+struct liftoff_rpi_layer *
+liftoff_rpi_output_scene_layer_get(struct liftoff_rpi_output *output, uint64_t key)
+{
+   return scene_layer_find(output, key);
+}
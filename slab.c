@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+#define SLAB_ALIGN _Alignof(max_align_t)
+#define SLAB_ROUND(size) (((size) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+struct slab_chunk
+{
+   struct slab_chunk *next;
+};
+
+struct slab_free
+{
+   struct slab_free *next;
+};
+
+void
+liftoff_rpi_slab_init(struct liftoff_rpi_slab *slab, size_t obj_size, size_t chunk_len)
+{
+   slab->chunks = NULL;
+   slab->free = NULL;
+   slab->obj_size = SLAB_ROUND(obj_size);
+   slab->chunk_len = (chunk_len > 0 ? chunk_len : 1);
+}
+
+void
+liftoff_rpi_slab_fini(struct liftoff_rpi_slab *slab)
+{
+   struct slab_chunk *chunk, *next;
+
+   for (chunk = slab->chunks; chunk; chunk = next)
+     {
+        next = chunk->next;
+        free(chunk);
+     }
+
+   slab->chunks = NULL;
+   slab->free = NULL;
+}
+
+static int
+slab_grow(struct liftoff_rpi_slab *slab)
+{
+   struct slab_chunk *chunk;
+   struct slab_free *obj;
+   char *base;
+   size_t i;
+
+   chunk = malloc(SLAB_ROUND(sizeof(*chunk)) +
+                  slab->obj_size * slab->chunk_len);
+   if (!chunk) return -ENOMEM;
+
+   chunk->next = slab->chunks;
+   slab->chunks = chunk;
+
+   /* thread back to front so objects are handed out in address order */
+   base = (char *)chunk + SLAB_ROUND(sizeof(*chunk));
+   i = slab->chunk_len;
+   while (i-- > 0)
+     {
+        obj = (struct slab_free *)(base + i * slab->obj_size);
+        obj->next = slab->free;
+        slab->free = obj;
+     }
+
+   return 0;
+}
+
+void *
+liftoff_rpi_slab_alloc(struct liftoff_rpi_slab *slab)
+{
+   struct slab_free *obj;
+
+   if (!slab->free && slab_grow(slab) != 0)
+     return NULL;
+
+   obj = slab->free;
+   slab->free = obj->next;
+
+   memset(obj, 0, slab->obj_size);
+   return obj;
+}
+
+void
+liftoff_rpi_slab_free(struct liftoff_rpi_slab *slab, void *obj)
+{
+   struct slab_free *elm = obj;
+
+   if (!obj) return;
+
+   elm->next = slab->free;
+   slab->free = elm;
+}
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include "private.h"
+
+/* Text snapshot of what liftoff_rpi_device_create and
+ * liftoff_rpi_plane_create read from the kernel, for replaying the
+ * allocator against a copy of real hardware. One record per line:
+ *
+ *    liftoff_rpi-snapshot 1
+ *    device <min_width> <max_width> <min_height> <max_height>
+ *    crtc <id>
+ *    plane <id> <type> <possible_crtcs> <zpos>
+ *    prop <id> <flags> <value> <name>
+ *    value <value>                      (ranges and bitmask/enum values)
+ *    enum <value> <name>
+ *    blob <length> <hex bytes>          (the blob the last prop points to)
+ *    end
+ *
+ * Planes are listed by ID, as the kernel lists them, so a snapshot
+ * replayed in file order registers the same way. Props follow their plane
+ * and values, enums and blobs follow their prop. Names run to the end of
+ * the line. */
+
+static void
+snapshot_blob_write(FILE *f, int fd, uint64_t id)
+{
+   drmModePropertyBlobRes *blob;
+   const uint8_t *data;
+   uint32_t i = 0;
+
+   blob = drmModeGetPropertyBlob(fd, (uint32_t)id);
+   if (!blob) return;
+
+   data = blob->data;
+   fprintf(f, "blob %"PRIu32" ", blob->length);
+   for (; i < blob->length; i++)
+     fprintf(f, "%02x", data[i]);
+   fputs("\n", f);
+
+   drmModeFreePropertyBlob(blob);
+}
+
+static void
+snapshot_prop_write(FILE *f, int fd, drmModePropertyRes *dprop, uint64_t value)
+{
+   int i = 0;
+
+   fprintf(f, "prop %"PRIu32" 0x%"PRIx32" %"PRIu64" %s\n",
+           dprop->prop_id, dprop->flags, value, dprop->name);
+
+   for (; i < dprop->count_values; i++)
+     fprintf(f, "value %"PRIu64"\n", dprop->values[i]);
+
+   for (i = 0; i < dprop->count_enums; i++)
+     fprintf(f, "enum %"PRIu64" %s\n", dprop->enums[i].value,
+             dprop->enums[i].name);
+
+   if ((dprop->flags & DRM_MODE_PROP_BLOB) && (value))
+     snapshot_blob_write(f, fd, value);
+}
+
+static int
+snapshot_plane_write(FILE *f, struct liftoff_rpi_device *dev, struct liftoff_rpi_plane *plane)
+{
+   drmModeObjectProperties *dprops;
+   drmModePropertyRes *dprop;
+   uint32_t i = 0;
+
+   fprintf(f, "plane %"PRIu32" %"PRIu32" 0x%"PRIx32" %d\n",
+           plane->id, plane->type, plane->possible_crtcs, plane->zpos);
+
+   /* current values aren't kept on the plane, so ask again */
+   dprops = drmModeObjectGetProperties(dev->fd, plane->id,
+                                       DRM_MODE_OBJECT_PLANE);
+   if (!dprops)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmModeObjectGetProperties");
+        return -errno;
+     }
+
+   for (; i < dprops->count_props; i++)
+     {
+        dprop = drmModeGetProperty(dev->fd, dprops->props[i]);
+        if (!dprop)
+          {
+             liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "drmModeGetProperty");
+             drmModeFreeObjectProperties(dprops);
+             return -errno;
+          }
+
+        snapshot_prop_write(f, dev->fd, dprop, dprops->prop_values[i]);
+        drmModeFreeProperty(dprop);
+     }
+
+   drmModeFreeObjectProperties(dprops);
+   return 0;
+}
+
+/* the plane with the lowest ID above last */
+static struct liftoff_rpi_plane *
+snapshot_plane_next(struct liftoff_rpi_device *dev, uint32_t last)
+{
+   struct liftoff_rpi_plane *plane, *next = NULL;
+
+   liftoff_rpi_list_for_each(plane, &dev->planes, link)
+     {
+        if (plane->id > last && (!next || plane->id < next->id))
+          next = plane;
+     }
+
+   return next;
+}
+
+/* API functions */
+int
+liftoff_rpi_device_snapshot_save(struct liftoff_rpi_device *dev, const char *path)
+{
+   struct liftoff_rpi_plane *plane;
+   FILE *f;
+   size_t i = 0;
+   uint32_t last = 0;
+   int ret = 0;
+
+   f = fopen(path, "w");
+   if (!f)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "fopen");
+        return -errno;
+     }
+
+   fprintf(f, "liftoff_rpi-snapshot 1\n");
+   fprintf(f, "device %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32"\n",
+           dev->min_width, dev->max_width, dev->min_height, dev->max_height);
+
+   for (; i < dev->crtcs_len; i++)
+     fprintf(f, "crtc %"PRIu32"\n", dev->crtcs[i]);
+
+   while (ret == 0 && (plane = snapshot_plane_next(dev, last)))
+     {
+        ret = snapshot_plane_write(f, dev, plane);
+        last = plane->id;
+     }
+
+   if (ret == 0) fputs("end\n", f);
+
+   if (fclose(f) != 0 && ret == 0)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "fclose");
+        ret = -errno;
+     }
+
+   return ret;
+}
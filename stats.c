@@ -0,0 +1,163 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "private.h"
+
+static size_t
+stats_hist_bucket_get(uint64_t value)
+{
+   size_t n = 0;
+
+   while ((value) && (n < LIFTOFF_RPI_STATS_HIST_LEN - 1))
+     {
+        value >>= 1;
+        n++;
+     }
+
+   return n;
+}
+
+static void
+stats_page_unmap(struct liftoff_rpi_device *dev)
+{
+   if (!dev->stats_page) return;
+
+   munmap(dev->stats_page, sizeof(*dev->stats_page));
+   shm_unlink(dev->stats_name);
+   free(dev->stats_name);
+   dev->stats_page = NULL;
+   dev->stats_name = NULL;
+}
+
+/* local functions */
+void
+stats_output_publish(struct liftoff_rpi_output *output)
+{
+   struct liftoff_rpi_stats_output *slot;
+   uint32_t seq;
+
+   if (!output->dev->stats_page) return;
+   if (output->crtc_index >= LIFTOFF_RPI_STATS_OUTPUTS_MAX) return;
+
+   slot = &output->dev->stats_page->outputs[output->crtc_index];
+
+   /* seqlock: readers retry while seq is odd or has moved */
+   seq = slot->seq;
+   __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   output->stats.seq = seq + 1;
+   memcpy(slot, &output->stats, sizeof(*slot));
+
+   __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+stats_output_apply_record(struct liftoff_rpi_output *output, uint64_t test_commits, int64_t search_time)
+{
+   struct liftoff_rpi_stats_output *stats;
+   struct liftoff_rpi_layer *layer;
+
+   stats = &output->stats;
+
+   stats->applies++;
+   stats->test_commits += test_commits;
+   stats->test_commits_hist[stats_hist_bucket_get(test_commits)]++;
+
+   if (search_time > 0)
+     {
+        stats->search_time_ns += (uint64_t)search_time;
+        stats->search_time_us_hist
+          [stats_hist_bucket_get((uint64_t)search_time / 1000)]++;
+     }
+
+   stats->layers = 0;
+   stats->layers_composited = 0;
+   liftoff_rpi_list_for_each(layer, &output->layers, link)
+     {
+        if (layer->split_parent || layer->split_orphan) continue;
+        stats->layers++;
+        if (layer->composited) stats->layers_composited++;
+     }
+
+   stats_output_publish(output);
+}
+
+void
+stats_device_fini(struct liftoff_rpi_device *dev)
+{
+   stats_page_unmap(dev);
+}
+
+/* API functions */
+int
+liftoff_rpi_device_stats_publish(struct liftoff_rpi_device *dev, const char *name)
+{
+   struct liftoff_rpi_stats_page *page;
+   struct liftoff_rpi_output *output;
+   int fd, ret;
+
+   stats_page_unmap(dev);
+   if (!name) return 0;
+
+   fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "shm_open");
+        return -errno;
+     }
+
+   if (ftruncate(fd, (off_t)sizeof(*page)) != 0)
+     {
+        ret = -errno;
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return ret;
+     }
+
+   page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+   if (page == MAP_FAILED)
+     {
+        ret = -errno;
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "mmap");
+        close(fd);
+        shm_unlink(name);
+        return ret;
+     }
+   close(fd);
+
+   dev->stats_name = strdup(name);
+   if (!dev->stats_name)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "strdup");
+        munmap(page, sizeof(*page));
+        shm_unlink(name);
+        return -ENOMEM;
+     }
+
+   page->version = LIFTOFF_RPI_STATS_VERSION;
+   page->size = sizeof(*page);
+   page->outputs_len = (uint32_t)dev->crtcs_len;
+   if (page->outputs_len > LIFTOFF_RPI_STATS_OUTPUTS_MAX)
+     page->outputs_len = LIFTOFF_RPI_STATS_OUTPUTS_MAX;
+
+   /* readers check the magic last */
+   __atomic_store_n(&page->magic, LIFTOFF_RPI_STATS_MAGIC, __ATOMIC_RELEASE);
+
+   dev->stats_page = page;
+
+   liftoff_rpi_list_for_each(output, &dev->outputs, link)
+     stats_output_publish(output);
+
+   return 0;
+}
+
+void
+liftoff_rpi_output_stats_get(struct liftoff_rpi_output *output, struct liftoff_rpi_stats_output *stats)
+{
+   *stats = output->stats;
+   stats->seq = 0;
+}
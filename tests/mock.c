@@ -0,0 +1,942 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mock.h"
+
+struct mock_item
+{
+   uint32_t obj, prop;
+   uint64_t value;
+};
+
+struct _drmModeAtomicReq
+{
+   struct mock_item *items;
+   int cursor, cap;
+};
+
+struct mock mock;
+
+struct mock_prop_desc
+{
+   const char *name;
+   uint32_t flags;
+   int64_t min, max;
+};
+
+/* the props every plane gets, as the kernel types them */
+static const struct mock_prop_desc mock_plane_props[] =
+{
+   { "FB_ID", DRM_MODE_PROP_OBJECT, 0, 0 },
+   { "CRTC_ID", DRM_MODE_PROP_OBJECT, 0, 0 },
+   { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE, INT32_MIN, INT32_MAX },
+   { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE, INT32_MIN, INT32_MAX },
+   { "CRTC_W", DRM_MODE_PROP_RANGE, 0, INT32_MAX },
+   { "CRTC_H", DRM_MODE_PROP_RANGE, 0, INT32_MAX },
+   { "SRC_X", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+   { "SRC_Y", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+   { "SRC_W", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+   { "SRC_H", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+   { "FB_DAMAGE_CLIPS", DRM_MODE_PROP_BLOB, 0, 0 },
+};
+
+static uint32_t
+mock_id_next(void)
+{
+   return mock.next_id++;
+}
+
+static void
+mock_prop_fini(struct mock_prop *prop)
+{
+   free(prop->values);
+   free(prop->enums);
+   prop->values = NULL;
+   prop->enums = NULL;
+   prop->values_len = 0;
+   prop->enums_len = 0;
+}
+
+static struct mock_prop *
+mock_prop_find(uint32_t id, struct mock_plane **plane)
+{
+   size_t i = 0, j;
+
+   for (; i < mock.planes_len; i++)
+     {
+        for (j = 0; j < mock.planes[i].props_len; j++)
+          {
+             if (mock.planes[i].props[j].id != id) continue;
+             if (plane) *plane = &mock.planes[i];
+             return &mock.planes[i].props[j];
+          }
+     }
+
+   return NULL;
+}
+
+static struct mock_blob *
+mock_blob_get(uint32_t id)
+{
+   size_t i = 0;
+
+   for (; i < mock.blobs_len; i++)
+     {
+        if (mock.blobs[i].id == id) return &mock.blobs[i];
+     }
+
+   return NULL;
+}
+
+static struct mock_fb *
+mock_fb_get(uint32_t id)
+{
+   size_t i = 0;
+
+   for (; i < mock.fbs_len; i++)
+     {
+        if (mock.fbs[i].id == id) return &mock.fbs[i];
+     }
+
+   return NULL;
+}
+
+static int
+mock_value_add(struct mock_prop *prop, uint64_t value)
+{
+   uint64_t *values;
+
+   values = realloc(prop->values,
+                    (size_t)(prop->values_len + 1) * sizeof(*values));
+   if (!values) return -ENOMEM;
+
+   values[prop->values_len++] = value;
+   prop->values = values;
+   return 0;
+}
+
+static int
+mock_enum_add(struct mock_prop *prop, uint64_t value, const char *name)
+{
+   struct drm_mode_property_enum *enums;
+
+   enums = realloc(prop->enums,
+                   (size_t)(prop->enums_len + 1) * sizeof(*enums));
+   if (!enums) return -ENOMEM;
+
+   prop->enums = enums;
+   enums = &prop->enums[prop->enums_len++];
+   memset(enums, 0, sizeof(*enums));
+   enums->value = value;
+   strncpy(enums->name, name, sizeof(enums->name) - 1);
+   return 0;
+}
+
+/* the value prop has once req is committed */
+static uint64_t
+mock_prop_value_get(struct mock_plane *plane, struct mock_prop *prop, drmModeAtomicReq *req)
+{
+   uint64_t value;
+   int i = 0;
+
+   value = prop->value;
+   if (!req) return value;
+
+   for (; i < req->cursor; i++)
+     {
+        if (req->items[i].obj == plane->id && req->items[i].prop == prop->id)
+          value = req->items[i].value;
+     }
+
+   return value;
+}
+
+static uint64_t
+mock_value_get(struct mock_plane *plane, drmModeAtomicReq *req, const char *name)
+{
+   uint64_t value = 0;
+
+   mock_plane_value_get(plane, req, name, &value);
+   return value;
+}
+
+static bool
+mock_crtc_index_get(uint32_t id, size_t *index)
+{
+   size_t i = 0;
+
+   for (; i < mock.crtcs_len; i++)
+     {
+        if (mock.crtcs[i] != id) continue;
+        *index = i;
+        return true;
+     }
+
+   return false;
+}
+
+static int
+mock_prop_value_check(const struct mock_prop *prop, uint64_t value)
+{
+   uint64_t mask = 0;
+   int i = 0;
+
+   if ((prop->flags & DRM_MODE_PROP_IMMUTABLE) && value != prop->value)
+     return -EINVAL;
+
+   switch (prop->flags & (DRM_MODE_PROP_LEGACY_TYPE |
+                          DRM_MODE_PROP_EXTENDED_TYPE))
+     {
+      case DRM_MODE_PROP_RANGE:
+        if (prop->values_len == 2 &&
+            (value < prop->values[0] || value > prop->values[1]))
+          return -EINVAL;
+        break;
+      case DRM_MODE_PROP_SIGNED_RANGE:
+        if (prop->values_len == 2 &&
+            ((int64_t)value < (int64_t)prop->values[0] ||
+             (int64_t)value > (int64_t)prop->values[1]))
+          return -EINVAL;
+        break;
+      case DRM_MODE_PROP_ENUM:
+        for (; i < prop->enums_len; i++)
+          {
+             if (prop->enums[i].value == value) return 0;
+          }
+        return -EINVAL;
+      case DRM_MODE_PROP_BITMASK:
+        for (; i < prop->enums_len; i++)
+          mask |= 1ull << prop->enums[i].value;
+        if (value & ~mask) return -EINVAL;
+        break;
+      case DRM_MODE_PROP_BLOB:
+        if (value && !mock_blob_get((uint32_t)value)) return -EINVAL;
+        break;
+     }
+
+   return 0;
+}
+
+static int
+mock_req_check(drmModeAtomicReq *req)
+{
+   struct mock_plane *plane;
+   struct mock_prop *prop;
+   uint64_t value;
+   size_t i = 0, crtc;
+   unsigned int enabled = 0;
+   int j = 0;
+
+   for (; j < req->cursor; j++)
+     {
+        prop = mock_prop_find(req->items[j].prop, &plane);
+        if (!prop || plane->id != req->items[j].obj) return -EINVAL;
+        if (mock_prop_value_check(prop, req->items[j].value) != 0)
+          return -EINVAL;
+     }
+
+   for (; i < mock.planes_len; i++)
+     {
+        plane = &mock.planes[i];
+
+        value = mock_value_get(plane, req, "FB_ID");
+        if (value == 0) continue;
+        if (!mock_fb_get((uint32_t)value)) return -EINVAL;
+        enabled++;
+
+        value = mock_value_get(plane, req, "CRTC_ID");
+        if (!mock_crtc_index_get((uint32_t)value, &crtc) ||
+            !(plane->possible_crtcs & (1u << crtc)))
+          return -EINVAL;
+
+        if (plane->no_scale &&
+            (mock_value_get(plane, req, "CRTC_W") << 16 !=
+             mock_value_get(plane, req, "SRC_W") ||
+             mock_value_get(plane, req, "CRTC_H") << 16 !=
+             mock_value_get(plane, req, "SRC_H")))
+          return -EINVAL;
+     }
+
+   if (mock.planes_max && enabled > mock.planes_max) return -EINVAL;
+
+   return 0;
+}
+
+/* API functions */
+void
+mock_reset(void)
+{
+   size_t i = 0, j;
+
+   for (; i < mock.planes_len; i++)
+     {
+        for (j = 0; j < mock.planes[i].props_len; j++)
+          mock_prop_fini(&mock.planes[i].props[j]);
+     }
+
+   for (i = 0; i < mock.blobs_len; i++)
+     free(mock.blobs[i].data);
+
+   memset(&mock, 0, sizeof(mock));
+   mock.max_width = 8192;
+   mock.max_height = 8192;
+   mock.next_id = 1;
+}
+
+int
+mock_open(void)
+{
+   return open("/dev/null", O_RDWR | O_CLOEXEC);
+}
+
+void
+mock_device_set(uint32_t min_width, uint32_t max_width, uint32_t min_height, uint32_t max_height)
+{
+   mock.min_width = min_width;
+   mock.max_width = max_width;
+   mock.min_height = min_height;
+   mock.max_height = max_height;
+}
+
+void
+mock_crtc_add(uint32_t id)
+{
+   if (mock.crtcs_len == MOCK_CRTCS_MAX) abort();
+
+   mock.crtcs[mock.crtcs_len++] = id;
+   if (id >= mock.next_id) mock.next_id = id + 1;
+}
+
+struct mock_plane *
+mock_plane_add(uint32_t type, uint32_t possible_crtcs, int zpos, bool zpos_mutable)
+{
+   const struct mock_prop_desc *desc;
+   struct mock_plane *plane;
+   struct mock_prop *prop;
+   size_t i = 0;
+
+   if (mock.planes_len == MOCK_PLANES_MAX) abort();
+
+   plane = &mock.planes[mock.planes_len++];
+   memset(plane, 0, sizeof(*plane));
+   plane->id = mock_id_next();
+   plane->possible_crtcs = possible_crtcs;
+
+   prop = mock_prop_add(plane, "type",
+                        DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE, type);
+   if (mock_enum_add(prop, DRM_PLANE_TYPE_OVERLAY, "Overlay") != 0 ||
+       mock_enum_add(prop, DRM_PLANE_TYPE_PRIMARY, "Primary") != 0 ||
+       mock_enum_add(prop, DRM_PLANE_TYPE_CURSOR, "Cursor") != 0)
+     abort();
+
+   for (; i < sizeof(mock_plane_props) / sizeof(mock_plane_props[0]); i++)
+     {
+        desc = &mock_plane_props[i];
+        prop = mock_prop_add(plane, desc->name, desc->flags, 0);
+        if (desc->min == desc->max) continue;
+        if (mock_value_add(prop, (uint64_t)desc->min) != 0 ||
+            mock_value_add(prop, (uint64_t)desc->max) != 0)
+          abort();
+     }
+
+   if (zpos >= 0)
+     {
+        prop = mock_prop_add(plane, "zpos",
+                             DRM_MODE_PROP_RANGE |
+                             (zpos_mutable ? 0 : DRM_MODE_PROP_IMMUTABLE),
+                             (uint64_t)zpos);
+        if (mock_value_add(prop, zpos_mutable ? 0 : (uint64_t)zpos) != 0 ||
+            mock_value_add(prop, zpos_mutable ? 15 : (uint64_t)zpos) != 0)
+          abort();
+     }
+
+   return plane;
+}
+
+struct mock_plane *
+mock_plane_get(uint32_t id)
+{
+   size_t i = 0;
+
+   for (; i < mock.planes_len; i++)
+     {
+        if (mock.planes[i].id == id) return &mock.planes[i];
+     }
+
+   return NULL;
+}
+
+struct mock_prop *
+mock_prop_add(struct mock_plane *plane, const char *name, uint32_t flags, uint64_t value)
+{
+   struct mock_prop *prop;
+
+   if (plane->props_len == MOCK_PROPS_MAX) abort();
+
+   prop = &plane->props[plane->props_len++];
+   memset(prop, 0, sizeof(*prop));
+   prop->id = mock_id_next();
+   prop->flags = flags | DRM_MODE_PROP_ATOMIC;
+   prop->value = value;
+   strncpy(prop->name, name, sizeof(prop->name) - 1);
+
+   return prop;
+}
+
+struct mock_prop *
+mock_prop_get(struct mock_plane *plane, const char *name)
+{
+   size_t i = 0;
+
+   for (; i < plane->props_len; i++)
+     {
+        if (strcmp(plane->props[i].name, name) == 0)
+          return &plane->props[i];
+     }
+
+   return NULL;
+}
+
+uint32_t
+mock_blob_add(const void *data, uint32_t length)
+{
+   struct mock_blob *blob;
+
+   if (mock.blobs_len == MOCK_BLOBS_MAX) return 0;
+
+   blob = &mock.blobs[mock.blobs_len];
+   blob->data = malloc(length > 0 ? length : 1);
+   if (!blob->data) return 0;
+
+   memcpy(blob->data, data, length);
+   blob->length = length;
+   blob->id = mock_id_next();
+   mock.blobs_len++;
+
+   return blob->id;
+}
+
+uint32_t
+mock_fb_add(uint32_t width, uint32_t height, uint32_t format)
+{
+   struct mock_fb *fb;
+
+   if (mock.fbs_len == MOCK_FBS_MAX) abort();
+
+   fb = &mock.fbs[mock.fbs_len++];
+   fb->id = mock_id_next();
+   fb->width = width;
+   fb->height = height;
+   fb->format = format;
+
+   return fb->id;
+}
+
+bool
+mock_plane_value_get(struct mock_plane *plane, drmModeAtomicReq *req, const char *name, uint64_t *value)
+{
+   struct mock_prop *prop;
+
+   prop = mock_prop_get(plane, name);
+   if (!prop) return false;
+
+   *value = mock_prop_value_get(plane, prop, req);
+   return true;
+}
+
+/* Reads back what liftoff_rpi_device_snapshot_save wrote, see snapshot.c
+ * for the format */
+int
+mock_snapshot_load(const char *path)
+{
+   struct mock_plane *plane = NULL;
+   struct mock_prop *prop = NULL;
+   struct mock_blob *blob;
+   FILE *f;
+   char *line = NULL, *end, *name;
+   size_t cap = 0, lineno = 0;
+   uint32_t id, flags, length, i;
+   uint64_t value;
+   bool done = false;
+   int ret = -EINVAL;
+
+   f = fopen(path, "r");
+   if (!f) return -errno;
+
+   mock_reset();
+
+   while (!done && getline(&line, &cap, f) > 0)
+     {
+        lineno++;
+        line[strcspn(line, "\n")] = '\0';
+
+        if (lineno == 1)
+          {
+             if (strcmp(line, "liftoff_rpi-snapshot 1") != 0) goto out;
+             continue;
+          }
+
+        if (strncmp(line, "device ", 7) == 0)
+          {
+             if (sscanf(line + 7, "%"SCNu32" %"SCNu32" %"SCNu32" %"SCNu32,
+                        &mock.min_width, &mock.max_width,
+                        &mock.min_height, &mock.max_height) != 4)
+               goto out;
+          }
+        else if (strncmp(line, "crtc ", 5) == 0)
+          {
+             if (sscanf(line + 5, "%"SCNu32, &id) != 1 ||
+                 mock.crtcs_len == MOCK_CRTCS_MAX)
+               goto out;
+             mock_crtc_add(id);
+          }
+        else if (strncmp(line, "plane ", 6) == 0)
+          {
+             if (mock.planes_len == MOCK_PLANES_MAX) goto out;
+
+             /* type and zpos come again with the props */
+             plane = &mock.planes[mock.planes_len];
+             memset(plane, 0, sizeof(*plane));
+             plane->id = (uint32_t)strtoul(line + 6, &end, 10);
+             if (end == line + 6) goto out;
+             strtoul(end, &end, 10);
+             plane->possible_crtcs = (uint32_t)strtoul(end, &end, 0);
+             mock.planes_len++;
+             prop = NULL;
+          }
+        else if (strncmp(line, "prop ", 5) == 0)
+          {
+             if (!plane || plane->props_len == MOCK_PROPS_MAX) goto out;
+
+             id = (uint32_t)strtoul(line + 5, &end, 10);
+             flags = (uint32_t)strtoul(end, &end, 0);
+             value = strtoull(end, &end, 10);
+             if (*end != ' ') goto out;
+             name = end + 1;
+
+             prop = &plane->props[plane->props_len++];
+             memset(prop, 0, sizeof(*prop));
+             prop->id = id;
+             prop->flags = flags;
+             prop->value = value;
+             strncpy(prop->name, name, sizeof(prop->name) - 1);
+          }
+        else if (strncmp(line, "value ", 6) == 0)
+          {
+             if (!prop) goto out;
+             if (mock_value_add(prop, strtoull(line + 6, NULL, 10)) != 0)
+               goto out;
+          }
+        else if (strncmp(line, "enum ", 5) == 0)
+          {
+             if (!prop) goto out;
+             value = strtoull(line + 5, &end, 10);
+             if (*end != ' ' || mock_enum_add(prop, value, end + 1) != 0)
+               goto out;
+          }
+        else if (strncmp(line, "blob ", 5) == 0)
+          {
+             if (!prop || mock.blobs_len == MOCK_BLOBS_MAX) goto out;
+
+             length = (uint32_t)strtoul(line + 5, &end, 10);
+             if (*end != ' ' || strlen(end + 1) != (size_t)length * 2)
+               goto out;
+
+             blob = &mock.blobs[mock.blobs_len];
+             blob->data = malloc(length > 0 ? length : 1);
+             if (!blob->data) goto out;
+             blob->id = (uint32_t)prop->value;
+             blob->length = length;
+             mock.blobs_len++;
+
+             for (i = 0, end++; i < length; i++, end += 2)
+               {
+                  if (sscanf(end, "%2hhx", (unsigned char *)blob->data + i) != 1)
+                    goto out;
+               }
+          }
+        else if (strcmp(line, "end") == 0)
+          done = true;
+        else
+          goto out;
+
+        /* keep the IDs we hand out clear of the loaded ones */
+        if (plane && plane->id >= mock.next_id) mock.next_id = plane->id + 1;
+        if (prop && prop->id >= mock.next_id) mock.next_id = prop->id + 1;
+        if (prop && (prop->flags & DRM_MODE_PROP_BLOB) &&
+            prop->value >= mock.next_id)
+          mock.next_id = (uint32_t)prop->value + 1;
+     }
+
+   if (done) ret = 0;
+
+out:
+   if (ret != 0)
+     fprintf(stderr, "%s:%zu: can't parse snapshot\n", path, lineno);
+   free(line);
+   fclose(f);
+   return ret;
+}
+
+/* libdrm */
+int
+drmCloseBufferHandle(int fd, uint32_t handle)
+{
+   return 0;
+}
+
+drmModeRes *
+drmModeGetResources(int fd)
+{
+   drmModeRes *res;
+
+   res = calloc(1, sizeof(*res));
+   if (!res) return NULL;
+
+   res->crtcs = calloc(mock.crtcs_len + 1, sizeof(res->crtcs[0]));
+   if (!res->crtcs)
+     {
+        free(res);
+        return NULL;
+     }
+
+   memcpy(res->crtcs, mock.crtcs, mock.crtcs_len * sizeof(res->crtcs[0]));
+   res->count_crtcs = (int)mock.crtcs_len;
+   res->min_width = mock.min_width;
+   res->max_width = mock.max_width;
+   res->min_height = mock.min_height;
+   res->max_height = mock.max_height;
+
+   return res;
+}
+
+void
+drmModeFreeResources(drmModeRes *res)
+{
+   if (!res) return;
+
+   free(res->crtcs);
+   free(res);
+}
+
+drmModePlaneRes *
+drmModeGetPlaneResources(int fd)
+{
+   drmModePlaneRes *res;
+   size_t i = 0;
+
+   res = calloc(1, sizeof(*res));
+   if (!res) return NULL;
+
+   res->planes = calloc(mock.planes_len + 1, sizeof(res->planes[0]));
+   if (!res->planes)
+     {
+        free(res);
+        return NULL;
+     }
+
+   for (; i < mock.planes_len; i++)
+     res->planes[i] = mock.planes[i].id;
+   res->count_planes = (uint32_t)mock.planes_len;
+
+   return res;
+}
+
+void
+drmModeFreePlaneResources(drmModePlaneRes *res)
+{
+   if (!res) return;
+
+   free(res->planes);
+   free(res);
+}
+
+drmModePlane *
+drmModeGetPlane(int fd, uint32_t id)
+{
+   struct mock_plane *mplane;
+   drmModePlane *plane;
+
+   mplane = mock_plane_get(id);
+   if (!mplane)
+     {
+        errno = ENOENT;
+        return NULL;
+     }
+
+   plane = calloc(1, sizeof(*plane));
+   if (!plane) return NULL;
+
+   plane->plane_id = id;
+   plane->possible_crtcs = mplane->possible_crtcs;
+
+   return plane;
+}
+
+void
+drmModeFreePlane(drmModePlane *plane)
+{
+   free(plane);
+}
+
+drmModeObjectProperties *
+drmModeObjectGetProperties(int fd, uint32_t id, uint32_t type)
+{
+   struct mock_plane *plane;
+   drmModeObjectProperties *props;
+   size_t i = 0;
+
+   plane = mock_plane_get(id);
+   if (type != DRM_MODE_OBJECT_PLANE || !plane)
+     {
+        errno = ENOENT;
+        return NULL;
+     }
+
+   props = calloc(1, sizeof(*props));
+   if (!props) return NULL;
+
+   props->props = calloc(plane->props_len + 1, sizeof(props->props[0]));
+   props->prop_values = calloc(plane->props_len + 1,
+                               sizeof(props->prop_values[0]));
+   if (!props->props || !props->prop_values)
+     {
+        drmModeFreeObjectProperties(props);
+        return NULL;
+     }
+
+   for (; i < plane->props_len; i++)
+     {
+        props->props[i] = plane->props[i].id;
+        props->prop_values[i] = plane->props[i].value;
+     }
+   props->count_props = (uint32_t)plane->props_len;
+
+   return props;
+}
+
+void
+drmModeFreeObjectProperties(drmModeObjectProperties *props)
+{
+   if (!props) return;
+
+   free(props->props);
+   free(props->prop_values);
+   free(props);
+}
+
+drmModePropertyRes *
+drmModeGetProperty(int fd, uint32_t id)
+{
+   struct mock_prop *mprop;
+   drmModePropertyRes *prop;
+
+   mprop = mock_prop_find(id, NULL);
+   if (!mprop)
+     {
+        errno = ENOENT;
+        return NULL;
+     }
+
+   prop = calloc(1, sizeof(*prop));
+   if (!prop) return NULL;
+
+   prop->prop_id = mprop->id;
+   prop->flags = mprop->flags;
+   memcpy(prop->name, mprop->name, sizeof(prop->name));
+
+   prop->values = calloc((size_t)mprop->values_len + 1,
+                         sizeof(prop->values[0]));
+   prop->enums = calloc((size_t)mprop->enums_len + 1,
+                        sizeof(prop->enums[0]));
+   if (!prop->values || !prop->enums)
+     {
+        drmModeFreeProperty(prop);
+        return NULL;
+     }
+
+   if (mprop->values_len > 0)
+     memcpy(prop->values, mprop->values,
+            (size_t)mprop->values_len * sizeof(prop->values[0]));
+   if (mprop->enums_len > 0)
+     memcpy(prop->enums, mprop->enums,
+            (size_t)mprop->enums_len * sizeof(prop->enums[0]));
+   prop->count_values = mprop->values_len;
+   prop->count_enums = mprop->enums_len;
+
+   return prop;
+}
+
+void
+drmModeFreeProperty(drmModePropertyRes *prop)
+{
+   if (!prop) return;
+
+   free(prop->values);
+   free(prop->enums);
+   free(prop);
+}
+
+uint32_t
+drmModeGetPropertyType(const drmModePropertyRes *prop)
+{
+   return prop->flags & (DRM_MODE_PROP_LEGACY_TYPE |
+                         DRM_MODE_PROP_EXTENDED_TYPE);
+}
+
+drmModePropertyBlobRes *
+drmModeGetPropertyBlob(int fd, uint32_t id)
+{
+   struct mock_blob *mblob;
+   drmModePropertyBlobRes *blob;
+
+   mblob = mock_blob_get(id);
+   if (!mblob)
+     {
+        errno = ENOENT;
+        return NULL;
+     }
+
+   blob = calloc(1, sizeof(*blob) + mblob->length);
+   if (!blob) return NULL;
+
+   blob->id = id;
+   blob->length = mblob->length;
+   blob->data = blob + 1;
+   memcpy(blob->data, mblob->data, mblob->length);
+
+   return blob;
+}
+
+void
+drmModeFreePropertyBlob(drmModePropertyBlobRes *blob)
+{
+   free(blob);
+}
+
+int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t size, uint32_t *id)
+{
+   *id = mock_blob_add(data, (uint32_t)size);
+   return *id ? 0 : -ENOMEM;
+}
+
+int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+   struct mock_blob *blob;
+
+   blob = mock_blob_get(id);
+   if (!blob) return -ENOENT;
+
+   free(blob->data);
+   *blob = mock.blobs[--mock.blobs_len];
+   return 0;
+}
+
+drmModeFB2 *
+drmModeGetFB2(int fd, uint32_t id)
+{
+   struct mock_fb *mfb;
+   drmModeFB2 *fb;
+
+   mfb = mock_fb_get(id);
+   if (!mfb)
+     {
+        errno = EINVAL;
+        return NULL;
+     }
+
+   fb = calloc(1, sizeof(*fb));
+   if (!fb) return NULL;
+
+   fb->fb_id = id;
+   fb->width = mfb->width;
+   fb->height = mfb->height;
+   fb->pixel_format = mfb->format;
+
+   return fb;
+}
+
+void
+drmModeFreeFB2(drmModeFB2 *fb)
+{
+   free(fb);
+}
+
+drmModeAtomicReq *
+drmModeAtomicAlloc(void)
+{
+   return calloc(1, sizeof(drmModeAtomicReq));
+}
+
+void
+drmModeAtomicFree(drmModeAtomicReq *req)
+{
+   if (!req) return;
+
+   free(req->items);
+   free(req);
+}
+
+int
+drmModeAtomicGetCursor(drmModeAtomicReq *req)
+{
+   return req->cursor;
+}
+
+void
+drmModeAtomicSetCursor(drmModeAtomicReq *req, int cursor)
+{
+   req->cursor = cursor;
+}
+
+int
+drmModeAtomicAddProperty(drmModeAtomicReq *req, uint32_t object_id, uint32_t property_id, uint64_t value)
+{
+   struct mock_item *items;
+   int cap;
+
+   if (req->cursor == req->cap)
+     {
+        cap = req->cap ? req->cap * 2 : 16;
+        items = realloc(req->items, (size_t)cap * sizeof(*items));
+        if (!items) return -ENOMEM;
+        req->items = items;
+        req->cap = cap;
+     }
+
+   req->items[req->cursor].obj = object_id;
+   req->items[req->cursor].prop = property_id;
+   req->items[req->cursor].value = value;
+
+   return ++req->cursor;
+}
+
+int
+drmModeAtomicCommit(int fd, drmModeAtomicReq *req, uint32_t flags, void *user_data)
+{
+   struct mock_plane *plane;
+   struct mock_prop *prop;
+   int i = 0, ret;
+
+   if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+     mock.test_commits++;
+   else
+     mock.commits++;
+
+   ret = mock_req_check(req);
+   if (ret != 0 || (flags & DRM_MODE_ATOMIC_TEST_ONLY)) return ret;
+
+   for (; i < req->cursor; i++)
+     {
+        prop = mock_prop_find(req->items[i].prop, &plane);
+        prop->value = req->items[i].value;
+     }
+
+   return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef LIFTOFF_RPI_MOCK_H
+# define LIFTOFF_RPI_MOCK_H
+
+# include <stdbool.h>
+# include <stdint.h>
+# include <xf86drm.h>
+# include <xf86drmMode.h>
+
+/* In-process stand-in for the libdrm KMS calls the library makes. Tests
+ * link it instead of libdrm, describe a device with the functions below
+ * (or load a snapshot saved by liftoff_rpi_device_snapshot_save) and hand
+ * the fd of mock_open to liftoff_rpi_device_create.
+ *
+ * Commits are checked against the current plane state with the request
+ * applied on top: an enabled plane needs a CRTC it can drive and a known
+ * FB, immutable props can't change, range props stay in range, planes
+ * marked no_scale reject scaling, and at most planes_max planes may be
+ * enabled at once. Anything else fails with -EINVAL. Commits without
+ * DRM_MODE_ATOMIC_TEST_ONLY update the plane state. */
+
+# define MOCK_CRTCS_MAX 8
+# define MOCK_PLANES_MAX 32
+# define MOCK_PROPS_MAX 24
+# define MOCK_FBS_MAX 256
+# define MOCK_BLOBS_MAX 128
+
+struct mock_prop
+{
+   uint32_t id, flags;
+   char name[DRM_PROP_NAME_LEN];
+   uint64_t value;
+
+   uint64_t *values;
+   int values_len;
+   struct drm_mode_property_enum *enums;
+   int enums_len;
+};
+
+struct mock_plane
+{
+   uint32_t id, possible_crtcs;
+   struct mock_prop props[MOCK_PROPS_MAX];
+   size_t props_len;
+
+   bool no_scale;
+};
+
+struct mock_blob
+{
+   uint32_t id, length;
+   void *data;
+};
+
+struct mock_fb
+{
+   uint32_t id, width, height, format;
+};
+
+struct mock
+{
+   uint32_t min_width, max_width, min_height, max_height;
+
+   uint32_t crtcs[MOCK_CRTCS_MAX];
+   size_t crtcs_len;
+
+   struct mock_plane planes[MOCK_PLANES_MAX];
+   size_t planes_len;
+
+   struct mock_blob blobs[MOCK_BLOBS_MAX];
+   size_t blobs_len;
+
+   struct mock_fb fbs[MOCK_FBS_MAX];
+   size_t fbs_len;
+
+   uint32_t next_id;
+
+   /* commit rules, 0 for no limit */
+   unsigned int planes_max;
+
+   /* test-only and real commits made so far */
+   unsigned int test_commits, commits;
+};
+
+extern struct mock mock;
+
+void mock_reset(void);
+int mock_open(void);
+void mock_device_set(uint32_t min_width, uint32_t max_width, uint32_t min_height, uint32_t max_height);
+void mock_crtc_add(uint32_t id);
+/* adds a plane with the usual props. zpos < 0 leaves out the zpos prop,
+ * zpos_mutable makes it a range the caller may set */
+struct mock_plane *mock_plane_add(uint32_t type, uint32_t possible_crtcs, int zpos, bool zpos_mutable);
+struct mock_plane *mock_plane_get(uint32_t id);
+struct mock_prop *mock_prop_get(struct mock_plane *plane, const char *name);
+struct mock_prop *mock_prop_add(struct mock_plane *plane, const char *name, uint32_t flags, uint64_t value);
+uint32_t mock_blob_add(const void *data, uint32_t length);
+uint32_t mock_fb_add(uint32_t width, uint32_t height, uint32_t format);
+/* value of a plane prop once req is committed, false if there's no such
+ * prop */
+bool mock_plane_value_get(struct mock_plane *plane, drmModeAtomicReq *req, const char *name, uint64_t *value);
+int mock_snapshot_load(const char *path);
+
+#endif
@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libliftoff_rpi.h>
+#include <libliftoff_rpi_stats.h>
+#include "mock.h"
+
+/* Change tracking is relative to the last applied frame, whether it was
+ * reallocated or reused: flips a layer to another FB of the same size,
+ * which keeps the allocation, and checks that the next unchanged frame
+ * is a no-op and that flipping back is seen as a change again. */
+
+#define LAYER_W 1920
+#define LAYER_H 1080
+
+struct frame
+{
+   const char *name;
+   int fb;
+   bool noop;
+   const char *kind;
+};
+
+static const struct frame frames[] =
+{
+   { "first", 0, false, "realloc" },
+   { "unchanged", 0, true, "noop" },
+   { "flip", 1, false, "reuse" },
+   { "unchanged after the flip", 1, true, "noop" },
+   { "flip back", 0, false, "reuse" },
+   { "unchanged after flipping back", 0, true, "noop" },
+};
+
+static const char *
+kind_get(const struct liftoff_rpi_stats_output *before, const struct liftoff_rpi_stats_output *after)
+{
+   if (after->noops != before->noops) return "noop";
+   if (after->reuses != before->reuses) return "reuse";
+   if (after->reallocs != before->reallocs) return "realloc";
+   return "error";
+}
+
+int
+main(void)
+{
+   struct liftoff_rpi_stats_output before, after;
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_output *output;
+   struct liftoff_rpi_layer *layer;
+   drmModeAtomicReq *req;
+   const char *kind;
+   uint32_t fbs[2];
+   size_t i = 0;
+   bool noop;
+   int fd, ret = 0;
+
+   liftoff_rpi_log_priority_set(LIFTOFF_RPI_SILENT);
+
+   mock_reset();
+   mock_device_set(16, 4096, 16, 4096);
+   mock_crtc_add(20);
+   mock_plane_add(DRM_PLANE_TYPE_PRIMARY, 1, 0, false);
+   mock_plane_add(DRM_PLANE_TYPE_OVERLAY, 1, 1, false);
+   fbs[0] = mock_fb_add(LAYER_W, LAYER_H, 0x34325258);
+   fbs[1] = mock_fb_add(LAYER_W, LAYER_H, 0x34325258);
+
+   fd = mock_open();
+   dev = liftoff_rpi_device_create(fd);
+   close(fd);
+   if (!dev || liftoff_rpi_device_register_planes(dev) != 0)
+     {
+        fprintf(stderr, "can't create the device\n");
+        liftoff_rpi_device_destroy(dev);
+        return 1;
+     }
+
+   output = liftoff_rpi_output_create(dev, 20);
+   layer = liftoff_rpi_layer_create(output);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_W, LAYER_W);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_H, LAYER_H);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_W,
+                                  (uint64_t)LAYER_W << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_H,
+                                  (uint64_t)LAYER_H << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_ZPOS, 0);
+
+   for (; i < sizeof(frames) / sizeof(frames[0]); i++)
+     {
+        liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_FB_ID,
+                                       fbs[frames[i].fb]);
+
+        liftoff_rpi_output_stats_get(output, &before);
+        req = drmModeAtomicAlloc();
+        if (liftoff_rpi_output_apply_noop(output, req, 0, &noop) != 0 ||
+            (!noop && drmModeAtomicCommit(fd, req, 0, NULL) != 0))
+          {
+             fprintf(stderr, "%s frame: apply failed\n", frames[i].name);
+             drmModeAtomicFree(req);
+             ret = 1;
+             break;
+          }
+        drmModeAtomicFree(req);
+        liftoff_rpi_output_stats_get(output, &after);
+
+        kind = kind_get(&before, &after);
+        printf("%s frame: %s\n", frames[i].name, kind);
+        if (noop != frames[i].noop || strcmp(kind, frames[i].kind) != 0)
+          {
+             fprintf(stderr, "%s frame: expected a %s\n", frames[i].name,
+                     frames[i].kind);
+             ret = 1;
+          }
+     }
+
+   liftoff_rpi_layer_destroy(layer);
+   liftoff_rpi_output_destroy(output);
+   liftoff_rpi_device_destroy(dev);
+   mock_reset();
+   return ret;
+}
@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libliftoff_rpi.h>
+#include "mock.h"
+
+/* Saves the mock device, loads the snapshot back into the mock and saves
+ * it again: both files have to match. Run with a snapshot path, the same
+ * is done starting from that snapshot. */
+
+static void
+topology_build(void)
+{
+   struct mock_plane *plane;
+   struct mock_prop *prop;
+   const uint32_t formats[] = { 0x34325241, 0x34325258, 0x3231564e };
+   uint8_t blob[24 + sizeof(formats)] = { 0 };
+   uint32_t header[6] = { 1, 0, 3, 24, 0, 0 };
+
+   mock_reset();
+   mock_device_set(16, 4096, 16, 4096);
+   mock_crtc_add(10);
+   mock_crtc_add(11);
+
+   mock_plane_add(DRM_PLANE_TYPE_PRIMARY, 1 << 0, 0, false);
+   mock_plane_add(DRM_PLANE_TYPE_PRIMARY, 1 << 1, 0, false);
+   mock_plane_add(DRM_PLANE_TYPE_CURSOR, 1 << 0, 7, false);
+   mock_plane_add(DRM_PLANE_TYPE_OVERLAY, 3, 2, true);
+
+   plane = mock_plane_add(DRM_PLANE_TYPE_OVERLAY, 3, 3, true);
+   prop = mock_prop_add(plane, "rotation", DRM_MODE_PROP_BITMASK,
+                        DRM_MODE_ROTATE_0);
+   prop->enums = calloc(2, sizeof(*prop->enums));
+   if (!prop->enums) abort();
+   prop->enums_len = 2;
+   prop->enums[0].value = 0;
+   strcpy(prop->enums[0].name, "rotate-0");
+   prop->enums[1].value = 2;
+   strcpy(prop->enums[1].name, "rotate-180");
+
+   memcpy(blob, header, sizeof(header));
+   memcpy(blob + 24, formats, sizeof(formats));
+   mock_prop_add(plane, "IN_FORMATS",
+                 DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE,
+                 mock_blob_add(blob, sizeof(blob)));
+}
+
+static int
+snapshot_save(const char *path)
+{
+   struct liftoff_rpi_device *dev;
+   int fd, ret;
+
+   fd = mock_open();
+   if (fd < 0)
+     {
+        perror("open");
+        return 1;
+     }
+
+   dev = liftoff_rpi_device_create(fd);
+   close(fd);
+   if (!dev)
+     {
+        fprintf(stderr, "liftoff_rpi_device_create failed\n");
+        return 1;
+     }
+
+   ret = liftoff_rpi_device_register_planes(dev);
+   if (ret == 0) ret = liftoff_rpi_device_snapshot_save(dev, path);
+   liftoff_rpi_device_destroy(dev);
+
+   if (ret != 0)
+     {
+        fprintf(stderr, "saving %s failed: %s\n", path, strerror(-ret));
+        return 1;
+     }
+
+   return 0;
+}
+
+static char *
+file_read(const char *path, size_t *len)
+{
+   FILE *f;
+   char *data;
+   long size;
+
+   f = fopen(path, "rb");
+   if (!f) return NULL;
+
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   rewind(f);
+
+   data = malloc((size_t)size + 1);
+   if (data && fread(data, 1, (size_t)size, f) != (size_t)size)
+     {
+        free(data);
+        data = NULL;
+     }
+   fclose(f);
+
+   *len = (size_t)size;
+   return data;
+}
+
+static int
+round_trip(const char *name)
+{
+   char *a, *b;
+   size_t a_len = 0, b_len = 0;
+   int ret = 1;
+
+   if (snapshot_save("snapshot-a.txt") != 0) return 1;
+
+   if (mock_snapshot_load("snapshot-a.txt") != 0)
+     {
+        fprintf(stderr, "%s: can't load its snapshot\n", name);
+        return 1;
+     }
+
+   if (snapshot_save("snapshot-b.txt") != 0) return 1;
+
+   a = file_read("snapshot-a.txt", &a_len);
+   b = file_read("snapshot-b.txt", &b_len);
+   if (a && b && a_len == b_len && memcmp(a, b, a_len) == 0)
+     {
+        printf("%s: round trip ok (%zu bytes)\n", name, a_len);
+        ret = 0;
+     }
+   else
+     fprintf(stderr, "%s: snapshot-a.txt and snapshot-b.txt differ\n", name);
+
+   free(a);
+   free(b);
+   return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+   int i = 1, ret;
+
+   topology_build();
+   ret = round_trip("mock device");
+
+   for (; i < argc; i++)
+     {
+        if (mock_snapshot_load(argv[i]) != 0)
+          {
+             ret = 1;
+             continue;
+          }
+        if (round_trip(argv[i]) != 0) ret = 1;
+     }
+
+   if (ret == 0)
+     {
+        unlink("snapshot-a.txt");
+        unlink("snapshot-b.txt");
+     }
+
+   mock_reset();
+   return ret;
+}
@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libliftoff_rpi.h>
+#include "mock.h"
+
+/* Splits a 3000 pixel wide layer at 1024 pixels and checks the three
+ * strips committed: side by side from the layer's CRTC_X, each showing
+ * its own part of the FB. Run once with SRC_X set and once without it,
+ * which has to behave as SRC_X 0. */
+
+#define LAYER_X 100
+#define LAYER_W 3000
+#define LAYER_H 200
+#define SPLIT_W 1024
+#define STRIPS 3
+
+static int
+split_check(bool src_x, uint64_t src_x0)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_output *output;
+   struct liftoff_rpi_layer *layer;
+   drmModeAtomicReq *req;
+   uint64_t fb_id, crtc_x, crtc_w, sx, sw, seen = 0;
+   size_t i = 0, strips = 0;
+   int fd, ret = 1, n = 0;
+
+   mock_reset();
+   mock_device_set(16, 4096, 16, 4096);
+   mock_crtc_add(20);
+   mock_plane_add(DRM_PLANE_TYPE_PRIMARY, 1, 0, false);
+   for (; n < STRIPS; n++)
+     mock_plane_add(DRM_PLANE_TYPE_OVERLAY, 1, n + 1, false);
+
+   fd = mock_open();
+   dev = liftoff_rpi_device_create(fd);
+   close(fd);
+   if (!dev || liftoff_rpi_device_register_planes(dev) != 0)
+     {
+        fprintf(stderr, "can't create the device\n");
+        liftoff_rpi_device_destroy(dev);
+        return 1;
+     }
+
+   output = liftoff_rpi_output_create(dev, 20);
+   liftoff_rpi_output_layer_split_set(output, SPLIT_W);
+
+   layer = liftoff_rpi_layer_create(output);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_FB_ID,
+                                  mock_fb_add(4096, LAYER_H, 0x34325258));
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_X, LAYER_X);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_W, LAYER_W);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_H, LAYER_H);
+   if (src_x)
+     liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_X,
+                                    src_x0 << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_W,
+                                  (uint64_t)LAYER_W << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_H,
+                                  (uint64_t)LAYER_H << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_ZPOS, 1);
+
+   req = drmModeAtomicAlloc();
+   if (liftoff_rpi_output_apply(output, req, 0) != 0 ||
+       drmModeAtomicCommit(fd, req, 0, NULL) != 0)
+     {
+        fprintf(stderr, "the split layer wasn't committed\n");
+        goto out;
+     }
+
+   for (i = 0; i < mock.planes_len; i++)
+     {
+        if (!mock_plane_value_get(&mock.planes[i], NULL, "FB_ID", &fb_id) ||
+            fb_id == 0)
+          continue;
+
+        mock_plane_value_get(&mock.planes[i], NULL, "CRTC_X", &crtc_x);
+        mock_plane_value_get(&mock.planes[i], NULL, "CRTC_W", &crtc_w);
+        mock_plane_value_get(&mock.planes[i], NULL, "SRC_X", &sx);
+        mock_plane_value_get(&mock.planes[i], NULL, "SRC_W", &sw);
+        printf("plane %"PRIu32": CRTC_X %"PRId64" W %"PRIu64", "
+               "SRC_X %"PRIu64" W %"PRIu64"\n", mock.planes[i].id,
+               (int64_t)crtc_x, crtc_w, sx >> 16, sw >> 16);
+
+        /* unscaled, so the source moves with the CRTC rectangle */
+        if ((int64_t)crtc_x < LAYER_X || sw != crtc_w << 16 ||
+            sx != ((crtc_x - LAYER_X + src_x0) << 16))
+          {
+             fprintf(stderr, "plane %"PRIu32" shows the wrong part of the "
+                     "FB\n", mock.planes[i].id);
+             goto out;
+          }
+
+        seen += crtc_w;
+        strips++;
+     }
+
+   if (strips != STRIPS || seen != LAYER_W)
+     {
+        fprintf(stderr, "%zu strips cover %"PRIu64" pixels\n", strips, seen);
+        goto out;
+     }
+
+   ret = 0;
+
+out:
+   drmModeAtomicFree(req);
+   liftoff_rpi_layer_destroy(layer);
+   liftoff_rpi_output_destroy(output);
+   liftoff_rpi_device_destroy(dev);
+   return ret;
+}
+
+int
+main(void)
+{
+   int ret = 0;
+
+   liftoff_rpi_log_priority_set(LIFTOFF_RPI_SILENT);
+
+   printf("with SRC_X\n");
+   if (split_check(true, 64) != 0) ret = 1;
+   printf("without SRC_X\n");
+   if (split_check(false, 0) != 0) ret = 1;
+
+   mock_reset();
+   return ret;
+}
@@ -0,0 +1,466 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libliftoff_rpi.h>
+#include "mock.h"
+
+/* Runs every strategy over random scenes, on a generated device and on
+ * each snapshot given, and reports per scene how far each one lands from
+ * the exhaustive search, the test commits and time it took and whether
+ * its result was invalid. Invalid means the apply failed, the mock
+ * rejected the real commit, or what would show on screen is wrong: layers
+ * stacked out of order, a plane with the wrong FB, or composited layers
+ * over a layer on a plane they overlap.
+ *
+ * A scene is three frames: the layers, then one of them moved, then moved
+ * back, which gives memoization something to find. The generated device
+ * is run a second time with every zpos mutable and
+ * liftoff_rpi_output_zpos_mutable_set.
+ *
+ * Last, the largest generated scene is searched exhaustively again under
+ * a DEADLINE_US deadline per frame, which every frame has to meet with
+ * fewer test commits than without it.
+ *
+ * Exits with 1 if any result was invalid or a deadline was missed.
+ * --bench runs more and bigger scenes. */
+
+#define SCENE_LAYERS_MAX 16
+#define SCENE_FRAMES 3
+#define CRTC_W 1920
+#define CRTC_H 1080
+#define DEADLINE_US 2000
+
+struct layer_desc
+{
+   int x, y, w, h, zpos;
+   bool scaled, composited;
+   uint32_t fb;
+};
+
+struct scene
+{
+   struct layer_desc layers[SCENE_LAYERS_MAX];
+   size_t layers_len;
+   unsigned int planes_max;
+};
+
+struct run
+{
+   int score;
+   unsigned int tests, invalid, missed;
+   int64_t time;
+};
+
+struct totals
+{
+   int64_t gap, time;
+   uint64_t tests;
+   unsigned int invalid, worse;
+};
+
+static const struct
+{
+   enum liftoff_rpi_strategy strategy;
+   const char *name;
+} strategies[] =
+{
+   { LIFTOFF_RPI_STRATEGY_EXHAUSTIVE, "exhaustive" },
+   { LIFTOFF_RPI_STRATEGY_BOUNDED, "bounded" },
+   { LIFTOFF_RPI_STRATEGY_GREEDY, "greedy" },
+   { LIFTOFF_RPI_STRATEGY_MEMOIZED, "memoized" },
+   { LIFTOFF_RPI_STRATEGY_AUTO, "auto" },
+   { LIFTOFF_RPI_STRATEGY_ZPOS_DP, "zpos-dp" },
+};
+
+#define STRATEGIES_LEN (sizeof(strategies) / sizeof(strategies[0]))
+
+static struct totals totals[STRATEGIES_LEN];
+static uint32_t seed_state;
+
+static int
+rand_get(int n)
+{
+   seed_state = seed_state * 1103515245u + 12345u;
+   return (int)((seed_state >> 8) % (uint32_t)n);
+}
+
+static int64_t
+now_get(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* two primaries, five overlays either CRTC can use and a cursor, stacked
+ * in that order */
+static void
+topology_generate(bool zpos_mutable)
+{
+   int i = 1;
+
+   mock_reset();
+   mock_device_set(16, 4096, 16, 4096);
+   mock_crtc_add(1000);
+   mock_crtc_add(1001);
+   mock_plane_add(DRM_PLANE_TYPE_PRIMARY, 1 << 0, 0, zpos_mutable);
+   mock_plane_add(DRM_PLANE_TYPE_PRIMARY, 1 << 1, 0, zpos_mutable);
+   for (; i <= 5; i++)
+     mock_plane_add(DRM_PLANE_TYPE_OVERLAY, 3, i, zpos_mutable);
+   mock_plane_add(DRM_PLANE_TYPE_CURSOR, 1 << 0, 6, zpos_mutable);
+}
+
+/* every other overlay can't scale, whatever the topology */
+static void
+topology_rules_set(void)
+{
+   struct mock_prop *prop;
+   size_t i = 0, overlays = 0;
+
+   for (; i < mock.planes_len; i++)
+     {
+        prop = mock_prop_get(&mock.planes[i], "type");
+        if (!prop || prop->value != DRM_PLANE_TYPE_OVERLAY) continue;
+        mock.planes[i].no_scale = (overlays++ % 2 == 1);
+     }
+}
+
+static void
+planes_disable(void)
+{
+   struct mock_prop *prop;
+   size_t i = 0;
+
+   for (; i < mock.planes_len; i++)
+     {
+        prop = mock_prop_get(&mock.planes[i], "FB_ID");
+        if (prop) prop->value = 0;
+        prop = mock_prop_get(&mock.planes[i], "CRTC_ID");
+        if (prop) prop->value = 0;
+     }
+}
+
+static void
+scene_generate(struct scene *scene, size_t layers_max)
+{
+   struct layer_desc *desc;
+   size_t i = 1;
+
+   memset(scene, 0, sizeof(*scene));
+   scene->layers_len = 3 + (size_t)rand_get((int)layers_max - 2);
+   scene->planes_max = 2 + (unsigned int)rand_get(4);
+   mock.fbs_len = 0;
+
+   /* the composition layer */
+   desc = &scene->layers[0];
+   desc->w = CRTC_W;
+   desc->h = CRTC_H;
+   desc->fb = mock_fb_add(CRTC_W, CRTC_H, 0x34325241);
+
+   for (; i < scene->layers_len; i++)
+     {
+        desc = &scene->layers[i];
+        desc->w = 64 + rand_get(CRTC_W / 2);
+        desc->h = 64 + rand_get(CRTC_H / 2);
+        desc->x = rand_get(CRTC_W - desc->w);
+        desc->y = rand_get(CRTC_H - desc->h);
+        desc->zpos = (int)i;
+        desc->scaled = (rand_get(3) == 0);
+        desc->composited = (rand_get(8) == 0);
+        desc->fb = mock_fb_add((uint32_t)(desc->scaled ? desc->w / 2 : desc->w),
+                               (uint32_t)(desc->scaled ? desc->h / 2 : desc->h),
+                               rand_get(2) ? 0x34325241 : 0x34325258);
+     }
+}
+
+static void
+layer_update(struct liftoff_rpi_layer *layer, const struct layer_desc *desc, int dx)
+{
+   int sw, sh;
+
+   sw = desc->scaled ? desc->w / 2 : desc->w;
+   sh = desc->scaled ? desc->h / 2 : desc->h;
+
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_FB_ID, desc->fb);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_X,
+                                  (uint64_t)(desc->x + dx));
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_Y,
+                                  (uint64_t)desc->y);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_W,
+                                  (uint64_t)desc->w);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_CRTC_H,
+                                  (uint64_t)desc->h);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_W,
+                                  (uint64_t)sw << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_SRC_H,
+                                  (uint64_t)sh << 16);
+   liftoff_rpi_layer_property_set(layer, LIFTOFF_RPI_PROP_ZPOS,
+                                  (uint64_t)desc->zpos);
+   if (desc->composited) liftoff_rpi_layer_fb_composited_set(layer);
+}
+
+static bool
+descs_intersect(const struct layer_desc *a, const struct layer_desc *b)
+{
+   return (a->x < b->x + b->w && b->x < a->x + a->w &&
+           a->y < b->y + b->h && b->y < a->y + a->h);
+}
+
+static struct mock_plane *
+layer_mock_plane_get(struct liftoff_rpi_layer *layer)
+{
+   struct liftoff_rpi_plane *plane;
+
+   plane = liftoff_rpi_layer_plane_get(layer);
+   if (!plane) return NULL;
+
+   return mock_plane_get(liftoff_rpi_plane_id_get(plane));
+}
+
+/* what the committed state shows against what the scene asks for */
+static bool
+frame_valid_get(struct liftoff_rpi_output *output, const struct scene *scene, struct liftoff_rpi_layer **layers)
+{
+   struct mock_plane *pa, *pb;
+   uint64_t za, zb, fb;
+   size_t i = 0, j;
+   bool composited = false;
+
+   for (; i < scene->layers_len; i++)
+     {
+        pa = layer_mock_plane_get(layers[i]);
+        if (!pa)
+          {
+             if (i > 0) composited = true;
+             continue;
+          }
+        if (!mock_plane_value_get(pa, NULL, "FB_ID", &fb) ||
+            fb != scene->layers[i].fb)
+          return false;
+     }
+
+   if (composited && !layer_mock_plane_get(layers[0])) return false;
+
+   for (i = 1; i < scene->layers_len; i++)
+     {
+        pa = layer_mock_plane_get(layers[i]);
+        if (!pa) continue;
+        if (!mock_plane_value_get(pa, NULL, "zpos", &za)) za = 0;
+
+        for (j = 1; j < scene->layers_len; j++)
+          {
+             if (i == j ||
+                 !descs_intersect(&scene->layers[i], &scene->layers[j]) ||
+                 scene->layers[j].zpos < scene->layers[i].zpos)
+               continue;
+
+             /* j is over i on screen */
+             pb = layer_mock_plane_get(layers[j]);
+             if (!pb) return false;
+             if (!mock_plane_value_get(pb, NULL, "zpos", &zb)) zb = 0;
+             if (zb <= za) return false;
+          }
+     }
+
+   return true;
+}
+
+/* deadline in ns from the start of each apply, 0 for none */
+static void
+scene_run(const struct scene *scene, size_t strategy, bool zpos_mutable, int64_t deadline, struct run *run)
+{
+   struct liftoff_rpi_device *dev;
+   struct liftoff_rpi_output *output;
+   struct liftoff_rpi_layer *layers[SCENE_LAYERS_MAX];
+   drmModeAtomicReq *req;
+   unsigned int tests;
+   size_t i, frame = 0;
+   int64_t start;
+   int fd, ret, moved;
+   bool met = true;
+
+   memset(run, 0, sizeof(*run));
+   planes_disable();
+   mock.planes_max = scene->planes_max;
+
+   fd = mock_open();
+   dev = liftoff_rpi_device_create(fd);
+   close(fd);
+   if (!dev || liftoff_rpi_device_register_planes(dev) != 0)
+     {
+        run->invalid = SCENE_FRAMES;
+        liftoff_rpi_device_destroy(dev);
+        return;
+     }
+
+   output = liftoff_rpi_output_create(dev, mock.crtcs[0]);
+   liftoff_rpi_output_strategy_set(output, strategies[strategy].strategy);
+   liftoff_rpi_output_zpos_mutable_set(output, zpos_mutable);
+
+   for (i = 0; i < scene->layers_len; i++)
+     {
+        layers[i] = liftoff_rpi_layer_create(output);
+        layer_update(layers[i], &scene->layers[i], 0);
+     }
+   liftoff_rpi_output_composition_layer_set(output, layers[0]);
+
+   moved = (int)scene->layers_len / 2;
+   for (; frame < SCENE_FRAMES; frame++)
+     {
+        if (frame > 0)
+          layer_update(layers[moved], &scene->layers[moved],
+                       frame == 1 ? 1 : 0);
+
+        req = drmModeAtomicAlloc();
+        tests = mock.test_commits;
+        start = now_get();
+        if (deadline)
+          ret = liftoff_rpi_output_apply_deadline(output, req, 0,
+                                                  start + deadline, &met);
+        else
+          ret = liftoff_rpi_output_apply(output, req, 0);
+        run->time += now_get() - start;
+        run->tests += mock.test_commits - tests;
+        if (!met) run->missed++;
+
+        if (ret != 0 || drmModeAtomicCommit(fd, req, 0, NULL) != 0 ||
+            !frame_valid_get(output, scene, layers))
+          run->invalid++;
+        drmModeAtomicFree(req);
+
+        for (i = 1; i < scene->layers_len; i++)
+          {
+             if (liftoff_rpi_layer_plane_get(layers[i])) run->score++;
+          }
+     }
+
+   for (i = 0; i < scene->layers_len; i++)
+     liftoff_rpi_layer_destroy(layers[i]);
+   liftoff_rpi_output_destroy(output);
+   liftoff_rpi_device_destroy(dev);
+}
+
+static void
+scenes_run(const char *topology, bool zpos_mutable, unsigned int scenes, size_t layers_max)
+{
+   struct scene scene;
+   struct run runs[STRATEGIES_LEN];
+   unsigned int n = 0;
+   size_t s;
+   int gap;
+
+   topology_rules_set();
+
+   for (; n < scenes; n++)
+     {
+        seed_state = n + 1;
+        scene_generate(&scene, layers_max);
+
+        for (s = 0; s < STRATEGIES_LEN; s++)
+          scene_run(&scene, s, zpos_mutable, 0, &runs[s]);
+
+        for (s = 0; s < STRATEGIES_LEN; s++)
+          {
+             gap = runs[0].score - runs[s].score;
+             printf("%s%s #%u (%zu layers, %u planes) %-10s gap %d, "
+                    "%u test commits, %"PRId64" us%s\n",
+                    topology, zpos_mutable ? " (zpos)" : "", n,
+                    scene.layers_len, scene.planes_max,
+                    strategies[s].name, gap, runs[s].tests,
+                    runs[s].time / 1000,
+                    runs[s].invalid ? ", INVALID" : "");
+
+             totals[s].gap += gap;
+             totals[s].time += runs[s].time;
+             totals[s].tests += runs[s].tests;
+             totals[s].invalid += runs[s].invalid;
+             if (gap > 0) totals[s].worse++;
+          }
+     }
+}
+
+static bool
+deadline_check(unsigned int scenes)
+{
+   struct scene scene;
+   struct run full, bounded;
+   unsigned int n = 0, largest = 0;
+   size_t layers_len = 0;
+
+   topology_generate(false);
+   topology_rules_set();
+
+   for (; n < scenes; n++)
+     {
+        seed_state = n + 1;
+        scene_generate(&scene, SCENE_LAYERS_MAX);
+        if (scene.layers_len > layers_len)
+          {
+             layers_len = scene.layers_len;
+             largest = n;
+          }
+     }
+
+   /* again, for its FBs */
+   seed_state = largest + 1;
+   scene_generate(&scene, SCENE_LAYERS_MAX);
+
+   scene_run(&scene, 0, false, 0, &full);
+   scene_run(&scene, 0, false, (int64_t)DEADLINE_US * 1000, &bounded);
+
+   printf("\ndeadline %d us (%zu layers, %u planes): %u test commits "
+          "instead of %u, %u of %d frames late%s\n", DEADLINE_US,
+          scene.layers_len, scene.planes_max, bounded.tests, full.tests,
+          bounded.missed, SCENE_FRAMES, bounded.invalid ? ", INVALID" : "");
+
+   return (bounded.missed == 0 && bounded.invalid == 0 &&
+           bounded.tests < full.tests);
+}
+
+int
+main(int argc, char *argv[])
+{
+   unsigned int scenes = 20, invalid = 0;
+   size_t layers_max = 10, s = 0;
+   int i = 1;
+
+   liftoff_rpi_log_priority_set(LIFTOFF_RPI_SILENT);
+
+   if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+     {
+        scenes = 200;
+        layers_max = SCENE_LAYERS_MAX;
+        i++;
+     }
+
+   topology_generate(false);
+   scenes_run("generated", false, scenes, layers_max);
+   topology_generate(true);
+   scenes_run("generated", true, scenes, layers_max);
+
+   for (; i < argc; i++)
+     {
+        if (mock_snapshot_load(argv[i]) != 0) return 1;
+        scenes_run(argv[i], false, scenes, layers_max);
+     }
+
+   printf("\n%-10s %8s %8s %12s %10s %8s\n",
+          "strategy", "gap", "worse", "test commits", "time us", "invalid");
+   for (; s < STRATEGIES_LEN; s++)
+     {
+        printf("%-10s %8"PRId64" %8u %12"PRIu64" %10"PRId64" %8u\n",
+               strategies[s].name, totals[s].gap, totals[s].worse,
+               totals[s].tests, totals[s].time / 1000, totals[s].invalid);
+        invalid += totals[s].invalid;
+     }
+
+   if (!deadline_check(scenes)) invalid++;
+
+   mock_reset();
+   return invalid ? 1 : 0;
+}
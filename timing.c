@@ -0,0 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include "private.h"
+
+int64_t
+timing_now_get(void)
+{
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "clock_gettime");
+        return 0;
+     }
+
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libliftoff_rpi_stats.h>
+
+/* Prints the statistics page published by liftoff_rpi_device_stats_publish.
+ *
+ *    liftoff_rpi_stats NAME [INTERVAL]
+ *
+ * With an interval in seconds the page is sampled until interrupted. */
+
+static void
+hist_print(const char *name, const uint64_t *hist)
+{
+   size_t i = 0, last = 0;
+
+   for (; i < LIFTOFF_RPI_STATS_HIST_LEN; i++)
+     {
+        if (hist[i]) last = i + 1;
+     }
+
+   printf("    %s:", name);
+   for (i = 0; i < last; i++)
+     printf(" %"PRIu64, hist[i]);
+   printf("\n");
+}
+
+static void
+output_print(const struct liftoff_rpi_stats_output *stats)
+{
+   uint64_t applies;
+   size_t i = 0;
+
+   applies = stats->applies ? stats->applies : 1;
+
+   printf("CRTC %"PRIu32"\n", stats->crtc_id);
+   printf("    applies: %"PRIu64" (noop %"PRIu64", reuse %"PRIu64
+          ", realloc %"PRIu64", error %"PRIu64")\n",
+          stats->applies, stats->noops, stats->reuses,
+          stats->reallocs, stats->errors);
+   if (stats->deadline_applies)
+     printf("    deadlines: %"PRIu64" (%"PRIu64" missed, %"PRIu64
+            " relaxed reuses)\n", stats->deadline_applies,
+            stats->deadline_misses, stats->relaxed_reuses);
+   if (stats->stagger_deferrals)
+     printf("    deferred for other outputs: %"PRIu64"\n",
+            stats->stagger_deferrals);
+   printf("    reuse rate: %.1f%%\n",
+          100.0 * (double)(stats->noops + stats->reuses) / (double)applies);
+   printf("    test commits: %"PRIu64" (%.1f per apply)\n",
+          stats->test_commits, (double)stats->test_commits / (double)applies);
+   printf("    search time: %"PRIu64" us total\n",
+          stats->search_time_ns / 1000);
+   printf("    layers: %"PRIu32" (%"PRIu32" composited)\n",
+          stats->layers, stats->layers_composited);
+   printf("    last strategy: %"PRIu32" (size %"PRIu32"), runs:",
+          stats->strategy, stats->search_size);
+   for (; i < LIFTOFF_RPI_STATS_STRATEGIES_MAX; i++)
+     printf(" %"PRIu64, stats->strategy_runs[i]);
+   printf("\n");
+   hist_print("search time us (log2)", stats->search_time_us_hist);
+   hist_print("test commits (log2)", stats->test_commits_hist);
+}
+
+int
+main(int argc, char **argv)
+{
+   const struct liftoff_rpi_stats_page *page;
+   struct liftoff_rpi_stats_output stats;
+   struct timespec interval = {0};
+   struct stat st;
+   uint32_t i;
+   int fd;
+
+   if (argc < 2)
+     {
+        fprintf(stderr, "usage: %s NAME [INTERVAL]\n", argv[0]);
+        return EXIT_FAILURE;
+     }
+
+   if (argc > 2) interval.tv_sec = atoi(argv[2]);
+
+   fd = shm_open(argv[1], O_RDONLY, 0);
+   if (fd < 0)
+     {
+        fprintf(stderr, "shm_open %s: %s\n", argv[1], strerror(errno));
+        return EXIT_FAILURE;
+     }
+
+   if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*page))
+     {
+        fprintf(stderr, "%s: not a statistics page\n", argv[1]);
+        close(fd);
+        return EXIT_FAILURE;
+     }
+
+   page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (page == MAP_FAILED)
+     {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+     }
+
+   if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != LIFTOFF_RPI_STATS_MAGIC ||
+       page->version != LIFTOFF_RPI_STATS_VERSION)
+     {
+        fprintf(stderr, "%s: unsupported statistics page\n", argv[1]);
+        return EXIT_FAILURE;
+     }
+
+   do
+     {
+        for (i = 0; i < page->outputs_len; i++)
+          {
+             if (!liftoff_rpi_stats_output_read(&page->outputs[i], &stats))
+               continue;
+             if (!stats.crtc_id) continue;
+             output_print(&stats);
+          }
+
+        if (interval.tv_sec) printf("\n");
+        fflush(stdout);
+     } while ((interval.tv_sec) && (nanosleep(&interval, NULL) == 0));
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdio.h>
+#include "private.h"
+
+/* Chrome trace event format, as read by ui.perfetto.dev. Each output gets
+ * its own track, keyed by CRTC id. The closing bracket is optional for
+ * readers, so a trace cut short by a crash still loads. */
+
+static FILE *trace_file = NULL;
+static bool trace_first = true;
+static int trace_pid = 0;
+
+static void
+trace_event_begin(const char *name, const char *ph, uint32_t tid, int64_t ts)
+{
+   fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"%s\","
+           "\"ts\":%"PRId64".%03d,\"pid\":%d,\"tid\":%"PRIu32,
+           trace_first ? "" : ",", name, ph, ts / 1000, (int)(ts % 1000),
+           trace_pid, tid);
+   trace_first = false;
+}
+
+static void
+trace_event_args(const char *fmt, va_list args)
+{
+   if (fmt)
+     {
+        fputs(",\"args\":{", trace_file);
+        vfprintf(trace_file, fmt, args);
+        fputs("}", trace_file);
+     }
+
+   fputs("}", trace_file);
+}
+
+bool
+trace_enabled(void)
+{
+   return trace_file != NULL;
+}
+
+void
+trace_begin(uint32_t tid, const char *name)
+{
+   if (!trace_file) return;
+
+   trace_event_begin(name, "B", tid, timing_now_get());
+   fputs("}", trace_file);
+}
+
+void
+trace_end(uint32_t tid, const char *name, const char *fmt, ...)
+{
+   va_list args;
+
+   if (!trace_file) return;
+
+   trace_event_begin(name, "E", tid, timing_now_get());
+   va_start(args, fmt);
+   trace_event_args(fmt, args);
+   va_end(args);
+}
+
+void
+trace_complete(uint32_t tid, const char *name, int64_t start, int64_t duration, const char *fmt, ...)
+{
+   va_list args;
+
+   if (!trace_file) return;
+
+   trace_event_begin(name, "X", tid, start);
+   fprintf(trace_file, ",\"dur\":%"PRId64".%03d",
+           duration / 1000, (int)(duration % 1000));
+   va_start(args, fmt);
+   trace_event_args(fmt, args);
+   va_end(args);
+}
+
+void
+trace_counter(uint32_t tid, const char *name, int64_t value)
+{
+   if (!trace_file) return;
+
+   trace_event_begin(name, "C", tid, timing_now_get());
+   fprintf(trace_file, ",\"args\":{\"crtc %"PRIu32"\":%"PRId64"}}",
+           tid, value);
+}
+
+void
+trace_test_commit(struct liftoff_rpi_output *output, struct liftoff_rpi_plane *plane, struct liftoff_rpi_layer *layer, int ret)
+{
+   struct liftoff_rpi_device *dev;
+
+   if (!trace_file) return;
+
+   dev = output->dev;
+   trace_complete(output->crtc_id, "device_test_commit",
+                  dev->test_commit_start, dev->test_commit_time,
+                  "\"plane\":%"PRIu32",\"layer\":\"%p\",\"ret\":%d",
+                  plane ? plane->id : 0, (void *)layer, ret);
+}
+
+/* API functions */
+int
+liftoff_rpi_trace_file_set(const char *path)
+{
+   if (trace_file)
+     {
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+     }
+
+   if (!path) return 0;
+
+   trace_file = fopen(path, "w");
+   if (!trace_file)
+     {
+        liftoff_rpi_log_errno(LIFTOFF_RPI_ERROR, "fopen");
+        return -errno;
+     }
+
+   fputs("[", trace_file);
+   trace_first = true;
+   trace_pid = getpid();
+
+   return 0;
+}